@@ -1,25 +1,68 @@
 
 var plugin = document.getElementById ("desktop-webapp-plugin");
 
-plugin.setIconLoaderCallback (function (url) {
+/* Returns a completion callback for the plugin's asynchronous methods */
+function logFailure (what)
+{
+    return function (success, error) {
+        if (!success) {
+            console.log (what + " failed: " + error);
+        }
+    };
+}
+
+plugin.setReadyCallback (function () {
+    console.log ("Desktop webapp plugin finished indexing installed apps");
+});
+
+/* Captures the tab showing each of the given URLs, one after the other,
+ * and hands the screenshots to the plugin as the apps' icons */
+function captureIcons (tabs_by_url, urls)
+{
+    if (urls.length == 0) {
+	return;
+    }
+
+    var url = urls.shift ();
+    var tab = tabs_by_url[url];
+    if (!tab) {
+	/* Let the plugin request other icons instead */
+	plugin.iconUnavailable (url);
+	captureIcons (tabs_by_url, urls);
+	return;
+    }
+
+    chrome.tabs.update (tab.id, { active: true }, function () {
+	chrome.tabs.captureVisibleTab (tab.windowId, { format: "png" }, function (data_url) {
+	    console.log ("Captured " + url + (data_url ? " (" + data_url.length + " bytes)" : ""));
+	    if (data_url) {
+		plugin.setIconForURL (url, data_url, logFailure ("Setting icon for " + url));
+	    } else {
+		plugin.iconUnavailable (url);
+	    }
+	    captureIcons (tabs_by_url, urls);
+	});
+    });
+}
+
+/* The plugin passes all the URLs it wants icons for as arguments */
+plugin.setIconLoaderCallback (function () {
+    var urls = Array.prototype.slice.call (arguments);
+
     chrome.windows.getAll({populate : true}, function (window_list) {
+	var tabs_by_url = {};
+
         for (var i = 0; i < window_list.length; i++) {
-	    var this_window = window_list[i];
-	    var tabs = this_window.tabs;
+	    var tabs = window_list[i].tabs;
 
 	    for (var j = 0; j < tabs.length; j++) {
-		if (tabs[j].url == url) {
-		    chrome.tabs.update (tabs[j].id, { active: true }, function (tab) {
-			chrome.tabs.captureVisibleTab (this_window.id, { format: "png" }, function (data_url) {
-			    console.log (data_url);
-			    plugin.setIconForURL (url, data_url);
-			});
-		    });
-
-		    return;
+		if (!(tabs[j].url in tabs_by_url)) {
+		    tabs_by_url[tabs[j].url] = tabs[j];
 		}
 	    }
 	}
+
+	captureIcons (tabs_by_url, urls);
     });
 });
 
@@ -55,6 +98,31 @@ function getImageDataURL(url, callback) {
     img.src = url;
 }
 
+/* Installations are queued and sent to the plugin in batches, so that
+ * Chrome syncing or updating many apps at once results in a single
+ * call to the plugin */
+var pending_installs = [];
+var pending_installs_timeout = null;
+
+function flushPendingInstalls ()
+{
+    var apps = pending_installs;
+
+    pending_installs = [];
+    pending_installs_timeout = null;
+
+    /* Call NPAPI plugin */
+    plugin.installChromeApps (apps, logFailure ("Installing Chrome apps"));
+}
+
+function queueInstall (app)
+{
+    pending_installs.push (app);
+    if (pending_installs_timeout == null) {
+        pending_installs_timeout = setTimeout (flushPendingInstalls, 200);
+    }
+}
+
 /* Register event listeners for apps/extensions events */
 chrome.management.onInstalled.addListener (function(info) {
     if (info.isApp) {
@@ -64,20 +132,37 @@ chrome.management.onInstalled.addListener (function(info) {
             "(" + info.name + ")");
         var icon_url = getIconUrl(info);
         getImageDataURL(icon_url, function(result){
-            /* Call NPAPI plugin */
-            plugin.installChromeApp (
-                info.id,
-                info.name,
-                info.description,
-                info.appLaunchUrl,
-                result.data);
+            queueInstall ({
+                id: info.id,
+                name: info.name,
+                description: info.description,
+                appLaunchUrl: info.appLaunchUrl,
+                icon: result.data
+            });
         });
     }
 });
 
+/* Uninstallations are batched the same way */
+var pending_uninstalls = [];
+var pending_uninstalls_timeout = null;
+
+function flushPendingUninstalls ()
+{
+    var ids = pending_uninstalls;
+
+    pending_uninstalls = [];
+    pending_uninstalls_timeout = null;
+
+    plugin.uninstallChromeApps (ids, logFailure ("Uninstalling Chrome apps"));
+}
+
 chrome.management.onUninstalled.addListener (function(id) {
     console.log ("Uninstalling Chrome app " + id);
-    plugin.uninstallChromeApp (id);
+    pending_uninstalls.push (id);
+    if (pending_uninstalls_timeout == null) {
+        pending_uninstalls_timeout = setTimeout (flushPendingUninstalls, 200);
+    }
 });
 
 chrome.management.getAll (function (all_apps) {
@@ -24,29 +24,218 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <unistd.h>
 #include "object.h"
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
+#include "webapp-desktop-entry.h"
+#include "webapp-icon.h"
 #include "webapp-monitor.h"
 
 typedef struct {
   NPObject object;
-  GHashTable *methods;
-  GQueue *ignored_desktop_files;
+  NPP instance;
+  GHashTable *ignored_apps;
 } WebappObjectWrapper;
 
 typedef NPVariant (*WebappMethod) (NPObject *object,
                                    const NPVariant *args,
                                    uint32_t argc);
 
+/* Argument schemas are strings with one character per argument: 's' for
+ * a string and 'o' for an object. Arguments after a '|' are optional and
+ * may also be null or undefined */
+typedef struct {
+  const NPUTF8 *name;
+  WebappMethod method;
+  const gchar *signature;
+} WebappMethodInfo;
+
+static NPVariant install_chrome_app_wrapper (NPObject *object, const NPVariant *args, uint32_t argc);
+static NPVariant install_chrome_apps_wrapper (NPObject *object, const NPVariant *args, uint32_t argc);
+static NPVariant uninstall_chrome_app_wrapper (NPObject *object, const NPVariant *args, uint32_t argc);
+static NPVariant uninstall_chrome_apps_wrapper (NPObject *object, const NPVariant *args, uint32_t argc);
+static NPVariant ignore_chrome_app_wrapper (NPObject *object, const NPVariant *args, uint32_t argc);
+static NPVariant set_icon_loader_callback_wrapper (NPObject *object, const NPVariant *args, uint32_t argc);
+static NPVariant set_icon_for_url_wrapper (NPObject *object, const NPVariant *args, uint32_t argc);
+static NPVariant icon_unavailable_wrapper (NPObject *object, const NPVariant *args, uint32_t argc);
+static NPVariant set_ready_callback_wrapper (NPObject *object, const NPVariant *args, uint32_t argc);
+
+/* Public methods */
+static const WebappMethodInfo webapp_methods[] = {
+  { "installChromeApp", install_chrome_app_wrapper, "sssss|o" },
+  { "installChromeApps", install_chrome_apps_wrapper, "o|o" },
+  { "uninstallChromeApp", uninstall_chrome_app_wrapper, "s|o" },
+  { "uninstallChromeApps", uninstall_chrome_apps_wrapper, "o|o" },
+  { "ignoreChromeApp", ignore_chrome_app_wrapper, "s" },
+  { "setIconLoaderCallback", set_icon_loader_callback_wrapper, "o" },
+  { "setIconForURL", set_icon_for_url_wrapper, "ss|o" },
+  { "iconUnavailable", icon_unavailable_wrapper, "s" },
+  { "setReadyCallback", set_ready_callback_wrapper, "o" }
+};
+
+/* NPIdentifier -> WebappMethodInfo, shared by all objects. Identifiers
+ * are resolved once, so method lookups are just pointer hashing */
+static GHashTable *method_table = NULL;
+
+/* Properties read from the app descriptors passed to installChromeApps */
+enum {
+  PROPERTY_LENGTH,
+  PROPERTY_ID,
+  PROPERTY_NAME,
+  PROPERTY_DESCRIPTION,
+  PROPERTY_ICON,
+  N_PROPERTIES
+};
+
+static const NPUTF8 *property_names[N_PROPERTIES] = {
+  "length",
+  "id",
+  "name",
+  "description",
+  "icon"
+};
+
+static NPIdentifier property_ids[N_PROPERTIES];
+
+static void
+init_method_table (void)
+{
+  const NPUTF8 *names[G_N_ELEMENTS (webapp_methods)];
+  NPIdentifier identifiers[G_N_ELEMENTS (webapp_methods)];
+  guint i;
+
+  if (G_LIKELY (method_table != NULL))
+    return;
+
+  for (i = 0; i < G_N_ELEMENTS (webapp_methods); i++)
+    names[i] = webapp_methods[i].name;
+
+  NPN_GetStringIdentifiers (names, G_N_ELEMENTS (webapp_methods), identifiers);
+  NPN_GetStringIdentifiers (property_names, N_PROPERTIES, property_ids);
+
+  method_table = g_hash_table_new (g_direct_hash, g_direct_equal);
+  for (i = 0; i < G_N_ELEMENTS (webapp_methods); i++) {
+    g_hash_table_insert (method_table,
+			 identifiers[i],
+			 (gpointer) &webapp_methods[i]);
+  }
+}
+
+static gboolean
+check_arguments (const WebappMethodInfo *info,
+		 const NPVariant *args,
+		 uint32_t argc)
+{
+  gboolean optional = FALSE;
+  const gchar *p;
+  guint i = 0;
+
+  for (p = info->signature; *p != '\0'; p++) {
+    if (*p == '|') {
+      optional = TRUE;
+      continue;
+    }
+
+    if (i >= argc)
+      return optional;
+
+    if (optional && (NPVARIANT_IS_NULL (args[i]) || NPVARIANT_IS_VOID (args[i]))) {
+      i++;
+      continue;
+    }
+
+    switch (*p) {
+    case 's':
+      if (!NPVARIANT_IS_STRING (args[i]))
+	return FALSE;
+      break;
+    case 'o':
+      if (!NPVARIANT_IS_OBJECT (args[i]))
+	return FALSE;
+      break;
+    default:
+      g_assert_not_reached ();
+    }
+
+    i++;
+  }
+
+  return TRUE;
+}
+
 static gchar *variant_to_string (const NPVariant variant)
 {
   return g_strndup (NPVARIANT_TO_STRING (variant).UTF8Characters,
 		    NPVARIANT_TO_STRING (variant).UTF8Length);
 }
 
+#define PNG_DATA_URL_PREFIX "data:image/png;base64,"
+
+/* Finds the base64 payload of the PNG data URL in @variant, which stays
+ * owned by the browser. Returns FALSE if @variant is not one */
+static gboolean
+get_png_data_url_payload (const NPVariant variant, const gchar **payload, gsize *len)
+{
+  const NPString *string;
+
+  if (!NPVARIANT_IS_STRING (variant))
+    return FALSE;
+
+  string = &NPVARIANT_TO_STRING (variant);
+  if (string->UTF8Length < strlen (PNG_DATA_URL_PREFIX) ||
+      strncmp (string->UTF8Characters, PNG_DATA_URL_PREFIX, strlen (PNG_DATA_URL_PREFIX)) != 0)
+    return FALSE;
+
+  /* skip the 'data:image/png;base64,' mime prefix */
+  *payload = string->UTF8Characters + strlen (PNG_DATA_URL_PREFIX);
+  *len = string->UTF8Length - strlen (PNG_DATA_URL_PREFIX);
+
+  return TRUE;
+}
+
+/* Decodes the base64 payload of a PNG data URL. The NPString buffer is
+ * only borrowed for the duration of the call and is decoded straight
+ * into the returned buffer, so the (potentially multi-megabyte) string
+ * is never copied. Returns NULL if @variant is not a PNG data URL */
+static GBytes *
+variant_to_png_data (const NPVariant variant)
+{
+  const gchar *payload;
+  gsize payload_len, len;
+  guchar *data;
+  gint state = 0;
+  guint save = 0;
+
+  if (!get_png_data_url_payload (variant, &payload, &payload_len))
+    return NULL;
+
+  data = g_malloc ((payload_len / 4) * 3 + 3);
+  len = g_base64_decode_step (payload, payload_len, data, &state, &save);
+
+  return g_bytes_new_take (data, len);
+}
+
+/* Returns the still encoded base64 payload of a PNG data URL, for icons
+ * that are only ever decoded into a pixbuf. Returns NULL if @variant is
+ * not a PNG data URL */
+static GBytes *
+variant_to_png_base64 (const NPVariant variant)
+{
+  const gchar *payload;
+  gsize len;
+
+  if (!get_png_data_url_payload (variant, &payload, &len))
+    return NULL;
+
+  return g_bytes_new (payload, len);
+}
+
 static NPObject *
 NPClass_Allocate (NPP instance, NPClass *klass)
 {
@@ -54,8 +243,8 @@ NPClass_Allocate (NPP instance, NPClass *klass)
 
   WebappObjectWrapper *wrapper = g_new0 (WebappObjectWrapper, 1);
 
-  wrapper->methods = g_hash_table_new (g_str_hash, g_str_equal);
-  wrapper->ignored_desktop_files = g_queue_new ();
+  wrapper->instance = instance;
+  wrapper->ignored_apps = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
   return (NPObject *) wrapper;
 }
@@ -67,8 +256,7 @@ NPClass_Deallocate (NPObject *npobj)
 
   g_return_if_fail (wrapper != NULL);
 
-  g_hash_table_unref (wrapper->methods);
-  g_queue_free_full (wrapper->ignored_desktop_files, g_free);
+  g_hash_table_destroy (wrapper->ignored_apps);
 
   g_free (wrapper);
 }
@@ -81,19 +269,9 @@ NPClass_Invalidate (NPObject *npobj)
 static bool
 NPClass_HasMethod (NPObject *npobj, NPIdentifier name)
 {
-  WebappObjectWrapper *wrapper = (WebappObjectWrapper *) npobj;
-  gchar *method_name;
-  gboolean has_method;
-
-  g_return_val_if_fail (wrapper != NULL, false);
+  g_return_val_if_fail (npobj != NULL, false);
 
-  method_name = NPN_UTF8FromIdentifier (name);
-  has_method = (g_hash_table_lookup (wrapper->methods, method_name) != NULL);
-
-  g_debug ("%s(\"%s\")", G_STRFUNC, method_name);
-
-  NPN_MemFree (method_name);
-  return has_method;
+  return g_hash_table_lookup (method_table, name) != NULL;
 }
 
 static bool
@@ -103,20 +281,22 @@ NPClass_Invoke (NPObject *npobj,
 		uint32_t argc,
 		NPVariant *result)
 {
-  WebappObjectWrapper *wrapper = (WebappObjectWrapper *) npobj;
-  gchar *method_name;
-  WebappMethod method;
+  const WebappMethodInfo *info;
 
-  g_return_val_if_fail (wrapper != NULL, false);
+  g_return_val_if_fail (npobj != NULL, false);
 
-  method_name = NPN_UTF8FromIdentifier (name);
-  method = g_hash_table_lookup (wrapper->methods, method_name);
-  NPN_MemFree (method_name);
-
-  if (G_UNLIKELY (method == NULL))
+  info = g_hash_table_lookup (method_table, name);
+  if (G_UNLIKELY (info == NULL))
     return false;
 
-  *result = method (npobj, args, argc);
+  if (G_UNLIKELY (!check_arguments (info, args, argc))) {
+    g_debug ("%s() wrong arguments for %s, expected '%s'", G_STRFUNC,
+	     info->name, info->signature);
+    NULL_TO_NPVARIANT (*result);
+    return true;
+  }
+
+  *result = info->method (npobj, args, argc);
   return true;
 }
 
@@ -186,522 +366,1499 @@ static NPClass js_object_class = {
   .construct = NPClass_Construct
 };
 
-static GdkPixbuf *
-get_pixbuf_from_data (gchar *icon_data)
-{
-  GdkPixbuf *pixbuf;
-  GInputStream *stream;
-  gsize len;
-  GError *error = NULL;
+/* Scriptable methods that need to do CPU or disk work run it as a job on
+ * a worker thread. Jobs run one after the other, in the order they were
+ * queued, so that operations on the same app never overlap. Once a job is
+ * done, completion is delivered back to the plugin thread through
+ * NPN_PluginThreadAsyncCall, where the optional JS callback is invoked as
+ * callback (success, error_message) */
+typedef gboolean (*WebappJobFunc) (gpointer data, GError **error);
+typedef void (*WebappJobDoneFunc) (gpointer data);
 
-  g_base64_decode_inplace (icon_data, &len);
-  stream = g_memory_input_stream_new_from_data (icon_data, len, NULL);
-  pixbuf = gdk_pixbuf_new_from_stream (stream, NULL, &error);
-  if (error != NULL) {
-    g_debug ("%s error: %s", G_STRFUNC, error->message);
-    g_error_free (error);
+typedef struct {
+  guint id;
 
-    return NULL;
-  }
+  /* Instance and objects of the caller, NULL once the instance is
+   * destroyed */
+  NPP instance;
+  NPObject *object;
+  NPObject *callback;
 
-  return pixbuf;
-}
+  WebappJobFunc func;
+  WebappJobDoneFunc done;
+  gpointer data;
+  GDestroyNotify data_free;
+  GError *error;
 
-static gboolean
-save_extension_icon (gchar *icon_data, const gchar *destination)
-{
-  GdkPixbuf *pixbuf;
-  GError *error = NULL;
-  gboolean result = FALSE;
+  /* Set once func has run */
+  gboolean finished;
+  guint idle_id;
+} WebappJob;
 
-  pixbuf = get_pixbuf_from_data (icon_data);
-  if (pixbuf) {
-    if (gdk_pixbuf_save (pixbuf, destination, "png", &error, NULL)) {
-      result = TRUE;
-    } else {
-      g_debug ("%s error: %s", G_STRFUNC, error->message);
-      g_error_free (error);
-    }
+static GThreadPool *job_pool = NULL;
 
-    g_object_unref (pixbuf);
-  }
+/* Pool the jobs spread their parallel work on, created on first use.
+ * It is only used from the job thread */
+static GThreadPool *task_pool = NULL;
 
-  return result;
-}
+/* Jobs not completed yet, by ID. Completions only carry the ID, so that
+ * a completion delivered twice or after shutdown finds nothing */
+static GHashTable *jobs = NULL;
+static guint last_job_id = 0;
+G_LOCK_DEFINE_STATIC (jobs);
 
-static gchar *
-get_desktop_file_path (const gchar *app_id,
-		       gchar **desktop_file_out)
+static void
+complete_job (void *user_data)
 {
-  gchar *desktop_file = NULL;
-  gchar *desktop_file_path = NULL;
+  WebappJob *job;
 
-  desktop_file = g_strdup_printf ("chrome-%s-Default.desktop", app_id);
-  desktop_file_path = g_strdup_printf ("%s/.local/share/applications/%s", g_get_home_dir (), desktop_file);
+  G_LOCK (jobs);
+  job = jobs != NULL ? g_hash_table_lookup (jobs, user_data) : NULL;
+  if (job != NULL)
+    g_hash_table_steal (jobs, user_data);
+  G_UNLOCK (jobs);
 
-  if (desktop_file_out != NULL)
-    *desktop_file_out = desktop_file;
-  else
-    g_free (desktop_file);
+  if (job == NULL)
+    return;
 
-  return desktop_file_path;
-}
+  if (job->idle_id != 0)
+    g_source_remove (job->idle_id);
 
-static NPVariant
-install_chrome_app_wrapper (NPObject *object,
-			    const NPVariant *args,
-			    uint32_t argc)
-{
-  WebappObjectWrapper *wrapper = (WebappObjectWrapper *) object;
-  NPVariant result;
-  gchar *app_id = NULL, *name = NULL, *description = NULL, *command = NULL, *icon = NULL;
-  GList *ignored_link = NULL;
-  gchar *desktop_file_path = NULL, *desktop_file = NULL;
+  if (job->done != NULL)
+    job->done (job->data);
 
-  NULL_TO_NPVARIANT (result);
+  if (job->callback != NULL) {
+    NPVariant args[2], result;
 
-  g_debug ("%s called", G_STRFUNC);
+    BOOLEAN_TO_NPVARIANT (job->error == NULL, args[0]);
+    if (job->error != NULL)
+      STRINGZ_TO_NPVARIANT (job->error->message, args[1]);
+    else
+      NULL_TO_NPVARIANT (args[1]);
+    NULL_TO_NPVARIANT (result);
 
-  if (G_UNLIKELY (argc < 5 &&
-		  !NPVARIANT_IS_STRING (args[0]) &&
-		  !NPVARIANT_IS_STRING (args[1]) &&
-		  !NPVARIANT_IS_STRING (args[2]) &&
-		  !NPVARIANT_IS_STRING (args[3]) &&
-		  !NPVARIANT_IS_STRING (args[4]))) {
-    g_debug ("%s() string expected for all arguments", G_STRFUNC);
-    return result;
-  }
+    if (!NPN_InvokeDefault (job->instance, job->callback, args, 2, &result))
+      g_debug ("%s failed calling JS callback", G_STRFUNC);
 
-  app_id = variant_to_string (args[0]);
-  if (G_UNLIKELY (app_id == NULL)) {
-    g_debug ("%s empty app id", G_STRFUNC);
-    return result;
+    NPN_ReleaseVariantValue (&result);
+    NPN_ReleaseObject (job->callback);
   }
 
-  name = variant_to_string (args[1]);
-  if (G_UNLIKELY (name == NULL)) {
-    g_debug ("%s empty name", G_STRFUNC);
-    goto out;
-  }
-  description = variant_to_string (args[2]);
-  command = variant_to_string (args[3]);
-  if (G_UNLIKELY (name == NULL)) {
-    g_debug ("%s empty URL", G_STRFUNC);
-    goto out;
+  if (job->error != NULL) {
+    g_debug ("%s job failed: %s", G_STRFUNC, job->error->message);
+    g_error_free (job->error);
   }
 
-  ignored_link = g_queue_find_custom (wrapper->ignored_desktop_files,
-      app_id, (GCompareFunc) g_strcmp0);
-  if (ignored_link != NULL) {
-    /* It's an update for a pre-installed app and we want to ignore it.
-     * This avoids the creation of a desktop file just because a
-     * pre-installed app was updated */
-    g_debug ("%s ignoring %s (%s)", G_STRFUNC, app_id, name);
-    goto out;
-  }
+  if (job->data_free != NULL)
+    job->data_free (job->data);
 
-  g_debug ("%s installing desktop file for %s (%s)", G_STRFUNC, app_id,
-      name);
+  if (job->object != NULL)
+    NPN_ReleaseObject (job->object);
+  g_free (job);
+}
 
-  /* Create .desktop file in ~/.local/share/applications */
-  desktop_file_path = get_desktop_file_path (app_id, &desktop_file);
-  if (desktop_file_path != NULL) {
-    GKeyFile *key_file = g_key_file_new ();
-    gchar *exec, *contents, *crx_app_id;
-    gsize size;
-    const gchar *categories[] = { "Network", "WebBrowser" };
+static gboolean
+complete_job_cb (gpointer user_data)
+{
+  WebappJob *job;
 
-    g_key_file_set_string (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_NAME, name);
-    g_key_file_set_string (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_GENERIC_NAME, name);
-    if (description != NULL) {
-      g_key_file_set_string (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_COMMENT, description);
-    }
+  G_LOCK (jobs);
+  job = jobs != NULL ? g_hash_table_lookup (jobs, user_data) : NULL;
+  if (job != NULL)
+    job->idle_id = 0;
+  G_UNLOCK (jobs);
 
-    exec = g_strdup_printf ("chromium \"--app-id=%s\"", app_id);
-    g_key_file_set_string (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_EXEC, exec);
-    g_free (exec);
+  complete_job (user_data);
 
-    g_key_file_set_boolean (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_TERMINAL, FALSE);
-    g_key_file_set_string_list (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_CATEGORIES, categories, G_N_ELEMENTS (categories));
-    g_key_file_set_string (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_TYPE, G_KEY_FILE_DESKTOP_TYPE_APPLICATION);
-    g_key_file_set_boolean (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_STARTUP_NOTIFY, TRUE);
+  return FALSE;
+}
 
-    crx_app_id = g_strdup_printf ("crx_%s", app_id);
-    g_key_file_set_string (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_STARTUP_WM_CLASS, crx_app_id);
-    g_free (crx_app_id);
+static void
+run_job (gpointer data, gpointer user_data)
+{
+  WebappJob *job = (WebappJob *) data;
+  gpointer id = GUINT_TO_POINTER (job->id);
 
-    /* Retrieve icon data and save it */
-    icon = variant_to_string (args[4]);
-    if (icon != NULL && g_str_has_prefix (icon, "data:image/png;base64,")) {
-      gchar *icon_buffer, *icon_file_path, *icon_file;
+  if (!job->func (job->data, &job->error) && job->error == NULL) {
+    g_set_error_literal (&job->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+			 "Operation failed");
+  }
 
-      /* skip the 'data:image/png;base64,' mime prefix */
-      icon_buffer = icon + 22;
+  /* Jobs of destroyed instances complete in the main context, without
+   * their callback */
+  G_LOCK (jobs);
+  job->finished = TRUE;
+  if (job->instance != NULL)
+    NPN_PluginThreadAsyncCall (job->instance, complete_job, id);
+  else
+    job->idle_id = g_idle_add (complete_job_cb, id);
+  G_UNLOCK (jobs);
+}
 
-      icon_file = g_strdup_printf ("chrome-%s", app_id);
-      icon_file_path = g_strdup_printf ("%s/.local/share/icons/%s.png", g_get_home_dir (), icon_file);
+/* Detaches the jobs of @instance from it, as it is being destroyed. They
+ * still run, but their callbacks are dropped */
+void
+webapp_detach_jobs (NPP instance)
+{
+  GPtrArray *objects;
+  GHashTableIter iter;
+  WebappJob *job;
 
-      if (save_extension_icon (icon_buffer, icon_file_path))
-        g_key_file_set_string (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_ICON, icon_file);
-      else {
-        g_key_file_set_string (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_ICON, "chromium-browser.png");
-        g_debug ("%s failed saving %s file", G_STRFUNC, icon_file_path);
-      }
+  if (jobs == NULL)
+    return;
 
-      g_free (icon_file_path);
-      g_free (icon_file);
-    }
+  objects = g_ptr_array_new_with_free_func ((GDestroyNotify) NPN_ReleaseObject);
 
-    g_free (icon);
+  G_LOCK (jobs);
 
-    /* Save .desktop file */
-    contents = g_key_file_to_data (key_file, &size, NULL);
-    if (!g_file_set_contents (desktop_file_path, contents, size, NULL))
-      g_debug ("%s failed saving %s file", G_STRFUNC, desktop_file_path);
+  g_hash_table_iter_init (&iter, jobs);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &job)) {
+    if (job->instance != instance)
+      continue;
 
-    g_free (contents);
-    g_key_file_free (key_file);
-    g_free (desktop_file_path);
+    job->instance = NULL;
+    g_ptr_array_add (objects, job->object);
+    job->object = NULL;
+    if (job->callback != NULL)
+      g_ptr_array_add (objects, job->callback);
+    job->callback = NULL;
 
-    /* Add newly-installed app to Shell's favorites */
-    webapp_add_to_favorites (desktop_file);
+    /* The browser drops the completion already sent to the instance */
+    if (job->finished && job->idle_id == 0)
+      job->idle_id = g_idle_add (complete_job_cb, GUINT_TO_POINTER (job->id));
   }
 
-  g_free (desktop_file);
-
- out:
-  g_free (app_id);
-  g_free (name);
-  g_free (description);
-  g_free (command);
+  G_UNLOCK (jobs);
 
-  return result;
+  g_ptr_array_unref (objects);
 }
 
-static NPVariant
-ignore_chrome_app_wrapper (NPObject *object,
-			   const NPVariant *args,
-			   uint32_t argc)
+/* Waits for all queued jobs and completes them. Called when the plugin
+ * is unloaded, after all instances were destroyed */
+void
+webapp_shutdown_jobs (void)
 {
-  WebappObjectWrapper *wrapper = (WebappObjectWrapper *) object;
-  NPVariant result;
-  gchar *app_id = NULL;
-  gchar *desktop_file_path = NULL;
-
-  NULL_TO_NPVARIANT (result);
+  GList *ids, *l;
 
-  g_debug ("%s called", G_STRFUNC);
+  if (job_pool == NULL)
+    return;
 
-  if (G_UNLIKELY (argc < 1 &&
-		  !NPVARIANT_IS_STRING (args[0]))) {
-    g_debug ("%s() string expected for all arguments", G_STRFUNC);
-    return result;
-  }
+  g_thread_pool_free (job_pool, FALSE, TRUE);
+  job_pool = NULL;
 
-  app_id = variant_to_string (args[0]);
-  if (G_UNLIKELY (app_id == NULL)) {
-    g_debug ("%s empty app id", G_STRFUNC);
-    return result;
+  /* Jobs wait for their tasks, so there are none left by now */
+  if (task_pool != NULL) {
+    g_thread_pool_free (task_pool, FALSE, TRUE);
+    task_pool = NULL;
   }
 
-  desktop_file_path = get_desktop_file_path (app_id, NULL);
-  if (g_file_test (desktop_file_path, G_FILE_TEST_EXISTS)) {
-    /* This app already has a .desktop file installed. We are not going
-     * to ignore feature updates */
-    g_debug ("%s not ignoring app with ID %s", G_STRFUNC, app_id);
-    g_free (app_id);
-  } else {
-    /* This means that the app is a pre-installed  Chrome app and we don't
-     * want to show it on the desktop */
-    g_debug ("%s ignoring installed app with ID %s", G_STRFUNC, app_id);
-    /* Leave ownership of app_id */
-    g_queue_push_head (wrapper->ignored_desktop_files, app_id);
-  }
+  G_LOCK (jobs);
+  ids = g_hash_table_get_keys (jobs);
+  G_UNLOCK (jobs);
 
-  g_free (desktop_file_path);
+  for (l = ids; l != NULL; l = l->next)
+    complete_job (l->data);
+  g_list_free (ids);
 
-  return result;
+  G_LOCK (jobs);
+  g_hash_table_destroy (jobs);
+  jobs = NULL;
+  G_UNLOCK (jobs);
 }
 
-static NPVariant
-set_icon_loader_callback_wrapper (NPObject *object,
-				  const NPVariant *args,
-				  uint32_t argc)
+/* Returns the optional callback passed as argument #@index, if any */
+static NPObject *
+get_callback_argument (const NPVariant *args, uint32_t argc, uint32_t index)
 {
-  NPVariant result;
-  NPObject *callback;
-
-  NULL_TO_NPVARIANT (result);
+  if (argc <= index || !NPVARIANT_IS_OBJECT (args[index]))
+    return NULL;
 
-  g_debug ("%s called", G_STRFUNC);
+  return NPVARIANT_TO_OBJECT (args[index]);
+}
 
-  if (G_UNLIKELY (argc < 1 || !NPVARIANT_IS_OBJECT (args[0]))) {
-    g_debug ("%s() function callback expected for argument #1", G_STRFUNC);
-    return result;
-  }
+static void
+queue_job (WebappObjectWrapper *wrapper,
+	   NPObject *callback,
+	   WebappJobFunc func,
+	   WebappJobDoneFunc done,
+	   gpointer data,
+	   GDestroyNotify data_free)
+{
+  WebappJob *job;
+
+  if (G_UNLIKELY (job_pool == NULL))
+    job_pool = g_thread_pool_new (run_job, NULL, 1, FALSE, NULL);
+
+  job = g_new0 (WebappJob, 1);
+  job->instance = wrapper->instance;
+  job->object = NPN_RetainObject ((NPObject *) wrapper);
+  job->callback = callback != NULL ? NPN_RetainObject (callback) : NULL;
+  job->func = func;
+  job->done = done;
+  job->data = data;
+  job->data_free = data_free;
+
+  G_LOCK (jobs);
+  if (G_UNLIKELY (jobs == NULL))
+    jobs = g_hash_table_new (g_direct_hash, g_direct_equal);
+  do {
+    job->id = ++last_job_id;
+  } while (job->id == 0);
+  g_hash_table_insert (jobs, GUINT_TO_POINTER (job->id), job);
+  G_UNLOCK (jobs);
+
+  g_thread_pool_push (job_pool, job, NULL);
+}
 
-  callback = NPVARIANT_TO_OBJECT (args[0]);
-  webapp_monitor_set_icon_loader_callback (callback);
+/* Tasks a job pushed to task_pool and waits for */
+typedef struct {
+  GMutex lock;
+  GCond cond;
+  guint pending;
+} WebappTaskGroup;
 
-  return result;
-}
+typedef struct {
+  WebappTaskGroup *group;
+  GFunc func;
+  gpointer data;
+} WebappTask;
 
-static gchar *
-get_icon_for_url (const gchar *desktop_file_path, const gchar *url)
+static void
+run_task (gpointer data, gpointer user_data)
 {
-  GKeyFile *key_file;
-  gchar *s, *icon_file = NULL;
-  GError *error = NULL;
-
-  key_file = g_key_file_new ();
-  if (g_key_file_load_from_file (key_file, desktop_file_path, 0, &error)) {
-    gint n_exec_args;
-    gchar **exec_args, *s;
+  WebappTask *task = (WebappTask *) data;
+  WebappTaskGroup *group = task->group;
 
-    s = g_key_file_get_string (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_EXEC, NULL);
-    if (s != NULL) {
-      if (g_shell_parse_argv (s, &n_exec_args, &exec_args, &error)) {
-        gint i;
+  task->func (task->data, NULL);
+  g_free (task);
 
-        for (i = 0; i < n_exec_args && exec_args[i] != NULL; i++) {
-          if (!g_str_has_prefix (exec_args[i], "--app="))
-            continue;
+  g_mutex_lock (&group->lock);
+  if (--group->pending == 0)
+    g_cond_signal (&group->cond);
+  g_mutex_unlock (&group->lock);
+}
 
-          if (g_strcmp0 (exec_args[i] + 6, url))
-            continue;
+static void
+task_group_init (WebappTaskGroup *group)
+{
+  g_mutex_init (&group->lock);
+  g_cond_init (&group->cond);
+  group->pending = 0;
+}
 
-          icon_file = g_key_file_get_string (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_ICON, NULL);
+static void
+task_group_push (WebappTaskGroup *group, GFunc func, gpointer data)
+{
+  WebappTask *task;
 
-          g_debug ("%s found URL %s in file %s", G_STRFUNC, icon_file, desktop_file_path);
-          break;
-        }
+  if (G_UNLIKELY (task_pool == NULL))
+    task_pool = g_thread_pool_new (run_task, NULL, g_get_num_processors (), FALSE, NULL);
 
-        g_strfreev (exec_args);
-      } else {
-        g_debug ("%s failed parsing command line %s: %s", G_STRFUNC, s, error->message);
-        g_error_free (error);
-      }
+  task = g_new (WebappTask, 1);
+  task->group = group;
+  task->func = func;
+  task->data = data;
 
-      g_free (s);
-    }
-  } else {
-    g_warning ("%s could not parse desktop file %s: %s", G_STRFUNC, desktop_file_path, error->message);
-    g_error_free (error);
-  }
+  g_mutex_lock (&group->lock);
+  group->pending++;
+  g_mutex_unlock (&group->lock);
 
-  return icon_file;
+  g_thread_pool_push (task_pool, task, NULL);
 }
 
-static NPVariant
-set_icon_for_url_wrapper (NPObject *object,
-			  const NPVariant *args,
-			  uint32_t argc)
+/* Waits for all the tasks pushed to @group, and clears it */
+static void
+task_group_wait (WebappTaskGroup *group)
 {
-  NPVariant result;
-  gchar *icon, *url;
-
-  NULL_TO_NPVARIANT (result);
-
-  g_debug ("%s called", G_STRFUNC);
+  g_mutex_lock (&group->lock);
+  while (group->pending > 0)
+    g_cond_wait (&group->cond, &group->lock);
+  g_mutex_unlock (&group->lock);
 
-  if (G_UNLIKELY (argc < 2 ||
-		  !NPVARIANT_IS_STRING (args[0]) ||
-		  !NPVARIANT_IS_STRING (args[1]))) {
-    g_debug ("%s() string expected for all arguments", G_STRFUNC);
-    return result;
-  }
+  g_mutex_clear (&group->lock);
+  g_cond_clear (&group->cond);
+}
 
-  url = variant_to_string (args[0]);
-  if (G_UNLIKELY (url == NULL)) {
-    g_debug ("%s empty url", G_STRFUNC);
-    return result;
-  }
+static GdkPixbuf *
+finish_pixbuf_loader (GdkPixbufLoader *loader, GError **error)
+{
+  GdkPixbuf *pixbuf = NULL;
 
-  icon = variant_to_string (args[1]);
-  if (icon != NULL && g_str_has_prefix (icon, "data:image/png;base64,")) {
-    gchar *icon_buffer;
-    GdkPixbuf *pixbuf;
+  if (!gdk_pixbuf_loader_close (loader, error))
+    goto out;
 
-    /* skip the 'data:image/png;base64,' mime prefix */
-    icon_buffer = icon + 22;
+  pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+  if (pixbuf != NULL)
+    g_object_ref (pixbuf);
+  else
+    g_set_error_literal (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+			 "No image data");
 
-    pixbuf = get_pixbuf_from_data (icon_buffer);
-    if (pixbuf != NULL) {
-      gint width, size;
-      GdkPixbuf *final_pixbuf;
+ out:
+  g_object_unref (loader);
 
-      width = gdk_pixbuf_get_width (pixbuf);
-      if (width >= 256)
-        size = 256;
-      else if (width >= 128)
-        size = 128;
-      else if (width >= 48)
-        size = 48;
-      else if (width >= 32)
-        size = 32;
-      else if (width >= 24)
-        size = 24;
-      else
-        size = 16;
+  return pixbuf;
+}
 
-      final_pixbuf = gdk_pixbuf_scale_simple (pixbuf, size, size, GDK_INTERP_BILINEAR);
-      if (final_pixbuf != NULL) {
-        gchar *icon_file = NULL, *dir_path;
-        GDir *dir;
-        GError *error = NULL;
+/* Loads the decoded PNG data in @icon_data */
+static GdkPixbuf *
+get_pixbuf_from_data (GBytes *icon_data, GError **error)
+{
+  GdkPixbufLoader *loader;
+  const guchar *data;
+  gsize size;
 
-        /* Find the .desktop file for the URL */
-        dir_path = g_strdup_printf ("%s/.local/share/applications", g_get_home_dir ());
-        dir = g_dir_open (dir_path, 0, &error);
-        if (dir) {
-          const gchar *name;
+  data = g_bytes_get_data (icon_data, &size);
 
-          while ((name = g_dir_read_name (dir)) && !icon_file) {
-            gchar *desktop_file_path;
+  loader = gdk_pixbuf_loader_new_with_type ("png", error);
+  if (loader == NULL)
+    return NULL;
 
-            if (!g_str_has_prefix (name, "chrome-"))
-              continue;
+  if (!gdk_pixbuf_loader_write (loader, data, size, error)) {
+    gdk_pixbuf_loader_close (loader, NULL);
+    g_object_unref (loader);
+    return NULL;
+  }
 
-            desktop_file_path = g_strdup_printf ("%s/%s", dir_path, name);
+  return finish_pixbuf_loader (loader, error);
+}
 
-            g_debug ("%s processing desktop file %s", G_STRFUNC, desktop_file_path);
+/* Encoded bytes decoded at a time by get_pixbuf_from_base64 */
+#define ICON_DECODE_CHUNK_SIZE 16384
 
-            icon_file = get_icon_for_url (desktop_file_path, url);
+/* Loads the base64 encoded PNG data in @icon_base64, decoding it a chunk
+ * at a time straight into a GdkPixbufLoader. The image is decoded while
+ * the base64 is, and the decoded data is never held at full size */
+static GdkPixbuf *
+get_pixbuf_from_base64 (GBytes *icon_base64, GError **error)
+{
+  GdkPixbufLoader *loader;
+  guchar chunk[(ICON_DECODE_CHUNK_SIZE / 4) * 3 + 3];
+  const gchar *data;
+  gsize size, offset;
+  gint state = 0;
+  guint save = 0;
 
-            g_free (desktop_file_path);
-          }
+  data = g_bytes_get_data (icon_base64, &size);
 
-          g_dir_close (dir);
+  loader = gdk_pixbuf_loader_new_with_type ("png", error);
+  if (loader == NULL)
+    return NULL;
 
-          /* Save the icon */
-          if (icon_file != NULL) {
-            gchar *icon_dir_path, *icon_file_path;
+  for (offset = 0; offset < size; offset += ICON_DECODE_CHUNK_SIZE) {
+    gsize len;
 
-            icon_dir_path = g_strdup_printf ("%s/.local/share/icons/hicolor/%dx%d/apps", g_get_home_dir (), size, size);
-            icon_file_path = g_strdup_printf ("%s/%s.png", icon_dir_path, icon_file);
+    len = g_base64_decode_step (data + offset, MIN (ICON_DECODE_CHUNK_SIZE, size - offset),
+				chunk, &state, &save);
+    if (len > 0 && !gdk_pixbuf_loader_write (loader, chunk, len, error)) {
+      gdk_pixbuf_loader_close (loader, NULL);
+      g_object_unref (loader);
+      return NULL;
+    }
+  }
 
-            g_debug ("%s saving icon to %s", G_STRFUNC, icon_file_path);
+  return finish_pixbuf_loader (loader, error);
+}
 
-            error = NULL;
-            g_mkdir_with_parents (icon_dir_path, 0700);
-            if (!gdk_pixbuf_save (final_pixbuf, icon_file_path, "png", &error, NULL)) {
-              g_debug ("%s error: %s", G_STRFUNC, error->message);
-              g_error_free (error);
-            }
+/* Whether an extension icon with @header can be installed as is */
+static gboolean
+png_needs_transform (const WebappPngHeader *header)
+{
+  if (header->width > WEBAPP_ICON_MAX_SIZE || header->height > WEBAPP_ICON_MAX_SIZE)
+    return TRUE;
 
-            g_free (icon_file_path);
-            g_free (icon_dir_path);
-            g_free (icon_file);
-          }
-        }
+  if (header->bit_depth != 8 || header->interlace != 0)
+    return TRUE;
 
-        g_free (dir_path);
-        g_object_unref (final_pixbuf);
-      }
+  return header->color_type != WEBAPP_PNG_COLOR_RGB &&
+    header->color_type != WEBAPP_PNG_COLOR_RGBA;
+}
 
-      g_object_unref (pixbuf);
+static gboolean
+save_extension_icon (GBytes *icon_data, const gchar *destination, GError **error)
+{
+  GdkPixbuf *pixbuf;
+  WebappPngHeader header;
+  const gchar *data;
+  gsize size;
+  gint width, height;
+  gboolean result;
+
+  data = g_bytes_get_data (icon_data, &size);
+
+  /* The extension already sends a PNG we can use, so just write it.
+   * Damaged files go through the decoder, which rejects them */
+  if (webapp_png_parse_header ((const guchar *) data, size, &header) &&
+      !png_needs_transform (&header) &&
+      webapp_png_check_chunks ((const guchar *) data, size))
+    return g_file_set_contents (destination, data, size, error);
+
+  pixbuf = get_pixbuf_from_data (icon_data, error);
+  if (pixbuf == NULL)
+    return FALSE;
+
+  width = gdk_pixbuf_get_width (pixbuf);
+  height = gdk_pixbuf_get_height (pixbuf);
+  if (width > WEBAPP_ICON_MAX_SIZE || height > WEBAPP_ICON_MAX_SIZE) {
+    GdkPixbuf *scaled;
+
+    if (width >= height) {
+      height = MAX (1, height * WEBAPP_ICON_MAX_SIZE / width);
+      width = WEBAPP_ICON_MAX_SIZE;
+    } else {
+      width = MAX (1, width * WEBAPP_ICON_MAX_SIZE / height);
+      height = WEBAPP_ICON_MAX_SIZE;
     }
 
-    g_free (icon);
+    scaled = webapp_icon_scale (pixbuf, width, height);
+    g_object_unref (pixbuf);
+    if (scaled == NULL) {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+		   "Could not scale icon to %dx%d", width, height);
+      return FALSE;
+    }
+    pixbuf = scaled;
   }
 
-  g_free (url);
+  result = gdk_pixbuf_save (pixbuf, destination, "png", error, NULL);
+  g_object_unref (pixbuf);
 
   return result;
 }
 
-static void
-remove_file (const gchar *path)
-{
-  GFile *fh;
+static gchar *
+get_desktop_file_path (const gchar *app_id,
+		       gchar **desktop_file_out)
+{
+  gchar *desktop_file = NULL;
+  gchar *desktop_file_path = NULL;
+
+  desktop_file = g_strdup_printf ("chrome-%s-Default.desktop", app_id);
+  desktop_file_path = g_strdup_printf ("%s/.local/share/applications/%s", g_get_home_dir (), desktop_file);
+
+  if (desktop_file_out != NULL)
+    *desktop_file_out = desktop_file;
+  else
+    g_free (desktop_file);
+
+  return desktop_file_path;
+}
+
+typedef struct {
+  gchar *app_id;
+  gchar *name;
+  gchar *description;
+  GBytes *icon_data;
+  gchar *icon;
+  gchar *desktop_file;
+} ChromeAppInfo;
+
+static void
+chrome_app_info_free (ChromeAppInfo *info)
+{
+  g_free (info->app_id);
+  g_free (info->name);
+  g_free (info->description);
+  if (info->icon_data != NULL)
+    g_bytes_unref (info->icon_data);
+  g_free (info->icon);
+  g_free (info->desktop_file);
+  g_free (info);
+}
+
+static gboolean
+is_ignored_app (WebappObjectWrapper *wrapper, const gchar *app_id)
+{
+  return g_hash_table_contains (wrapper->ignored_apps, app_id);
+}
+
+/* Icons sent by the extension are stored once per content in here, named
+ * after the checksum of their data, and ~/.local/share/icons/chrome-<id>.png
+ * are hard links to them */
+static gchar *
+get_icon_store_path (void)
+{
+  return g_build_filename (g_get_home_dir (), ".local/share/desktop-webapp/icons", NULL);
+}
+
+static gboolean
+is_same_file (const gchar *path1, const gchar *path2)
+{
+  struct stat buf1, buf2;
+
+  if (g_stat (path1, &buf1) != 0 || g_stat (path2, &buf2) != 0)
+    return FALSE;
+
+  return buf1.st_dev == buf2.st_dev && buf1.st_ino == buf2.st_ino;
+}
+
+/* Returns the path of @icon_data in the icon store, saving it there if
+ * no icon with the same data was saved before */
+static gchar *
+store_extension_icon (GBytes *icon_data, GError **error)
+{
+  gchar *store_path, *checksum, *name, *path, *tmp_path;
+  const gchar *data;
+  gsize size;
+  gint fd;
+
+  store_path = get_icon_store_path ();
+  if (g_mkdir_with_parents (store_path, 0755) != 0) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+		 "Could not create %s: %s", store_path, g_strerror (errno));
+    g_free (store_path);
+    return NULL;
+  }
+
+  data = g_bytes_get_data (icon_data, &size);
+  checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256, (const guchar *) data, size);
+  name = g_strconcat (checksum, ".png", NULL);
+  path = g_build_filename (store_path, name, NULL);
+  g_free (checksum);
+  g_free (name);
+  g_free (store_path);
+
+  if (g_file_test (path, G_FILE_TEST_EXISTS))
+    return path;
+
+  /* Save under a temporary name, so a partly written icon is never linked */
+  tmp_path = g_strconcat (path, ".XXXXXX", NULL);
+  fd = g_mkstemp_full (tmp_path, O_RDWR, 0644);
+  if (fd == -1) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+		 "Could not create %s: %s", tmp_path, g_strerror (errno));
+    g_free (tmp_path);
+    g_free (path);
+    return NULL;
+  }
+  close (fd);
+
+  if (!save_extension_icon (icon_data, tmp_path, error)) {
+    g_unlink (tmp_path);
+    g_free (tmp_path);
+    g_free (path);
+    return NULL;
+  }
+
+  if (g_rename (tmp_path, path) != 0) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+		 "Could not rename %s: %s", tmp_path, g_strerror (errno));
+    g_unlink (tmp_path);
+    g_free (tmp_path);
+    g_free (path);
+    return NULL;
+  }
+
+  g_free (tmp_path);
+
+  return path;
+}
 
-  fh = g_file_new_for_path (path);
-  g_file_delete (fh, NULL, NULL);
+/* Points @icon_file_path to @stored_path, leaving it untouched if it
+ * already does */
+static gboolean
+link_stored_icon (const gchar *stored_path, const gchar *icon_file_path)
+{
+  gchar *tmp_path;
+  gboolean result;
+  gint fd;
+
+  if (is_same_file (stored_path, icon_file_path))
+    return TRUE;
+
+  /* The link is made under a unique name, then renamed over the icon */
+  tmp_path = g_strconcat (icon_file_path, ".XXXXXX", NULL);
+  fd = g_mkstemp (tmp_path);
+  if (fd == -1) {
+    g_debug ("%s could not create %s: %s", G_STRFUNC, tmp_path, g_strerror (errno));
+    g_free (tmp_path);
+    return FALSE;
+  }
+  close (fd);
+  g_unlink (tmp_path);
+
+  result = link (stored_path, tmp_path) == 0 && g_rename (tmp_path, icon_file_path) == 0;
+  if (!result) {
+    g_debug ("%s could not link %s: %s", G_STRFUNC, icon_file_path, g_strerror (errno));
+    g_unlink (tmp_path);
+  }
+
+  g_free (tmp_path);
+
+  return result;
+}
+
+/* Removes the stored icons no app links to anymore */
+static void
+prune_icon_store (void)
+{
+  gchar *store_path;
+  const gchar *name;
+  GDir *dir;
+
+  store_path = get_icon_store_path ();
+  dir = g_dir_open (store_path, 0, NULL);
+  if (dir == NULL) {
+    g_free (store_path);
+    return;
+  }
+
+  while ((name = g_dir_read_name (dir)) != NULL) {
+    struct stat buf;
+    gchar *path;
 
-  g_object_unref (fh);
+    if (!g_str_has_suffix (name, ".png"))
+      continue;
+
+    path = g_build_filename (store_path, name, NULL);
+    if (g_stat (path, &buf) == 0 && buf.st_nlink == 1)
+      g_unlink (path);
+    g_free (path);
+  }
+
+  g_dir_close (dir);
+  g_free (store_path);
+}
+
+/* Saves the icon sent by the extension to ~/.local/share/icons and sets
+ * info->icon to the name to use in the desktop file. Only touches @info,
+ * so it can be run from any thread */
+static void
+save_chrome_app_icon (ChromeAppInfo *info)
+{
+  gchar *icon_file_path, *stored_path;
+  GError *error = NULL;
+  gboolean saved;
+
+  if (info->icon_data == NULL)
+    return;
+
+  icon_file_path = g_strdup_printf ("%s/.local/share/icons/chrome-%s.png", g_get_home_dir (), info->app_id);
+
+  /* Updates usually send the same icon again, which then costs no write */
+  stored_path = store_extension_icon (info->icon_data, &error);
+  if (stored_path != NULL && link_stored_icon (stored_path, icon_file_path))
+    saved = TRUE;
+  else {
+    if (error != NULL) {
+      g_debug ("%s failed storing %s: %s", G_STRFUNC, icon_file_path, error->message);
+      g_clear_error (&error);
+    }
+    /* Fall back to a plain copy, e.g. when hard links are not supported.
+     * Unlink first so that a stored icon linked here is not overwritten */
+    g_unlink (icon_file_path);
+    saved = save_extension_icon (info->icon_data, icon_file_path, &error);
+  }
+  g_free (stored_path);
+
+  if (saved)
+    info->icon = g_strdup_printf ("chrome-%s", info->app_id);
+  else {
+    info->icon = g_strdup ("chromium-browser.png");
+    g_debug ("%s failed saving %s file: %s", G_STRFUNC, icon_file_path,
+	     error != NULL ? error->message : "unknown error");
+    g_clear_error (&error);
+  }
+
+  g_free (icon_file_path);
+}
+
+static void
+save_chrome_app_icon_func (gpointer data, gpointer user_data)
+{
+  save_chrome_app_icon ((ChromeAppInfo *) data);
+}
+
+static void
+free_template_buffer (gpointer buffer)
+{
+  g_string_free (buffer, TRUE);
+}
+
+/* Per thread buffer the desktop files are built in */
+static GPrivate template_buffer = G_PRIVATE_INIT (free_template_buffer);
+
+/* Fills the chrome app desktop file template with @info into the
+ * calling thread's buffer, which is returned */
+static GString *
+build_chrome_app_desktop_file (ChromeAppInfo *info)
+{
+  GString *buffer;
+
+  buffer = g_private_get (&template_buffer);
+  if (buffer == NULL) {
+    buffer = g_string_sized_new (512);
+    g_private_set (&template_buffer, buffer);
+  }
+
+  g_string_truncate (buffer, 0);
+  webapp_desktop_entry_write_chrome_app (buffer, info->app_id, info->name,
+					 info->description, info->icon);
+
+  return buffer;
+}
+
+/* Creates the .desktop file in ~/.local/share/applications and sets
+ * info->desktop_file to its basename, to be added to Shell's favorites */
+static gboolean
+write_chrome_app_desktop_file (ChromeAppInfo *info, GError **error)
+{
+  gchar *desktop_file_path = NULL, *desktop_file = NULL;
+  GString *contents;
+  gboolean result;
+
+  g_debug ("%s installing desktop file for %s (%s)", G_STRFUNC, info->app_id,
+      info->name);
+
+  desktop_file_path = get_desktop_file_path (info->app_id, &desktop_file);
+
+  /* Save .desktop file */
+  contents = build_chrome_app_desktop_file (info);
+  result = webapp_monitor_write_desktop_file (desktop_file_path, contents->str, contents->len, error);
+  if (result)
+    info->desktop_file = desktop_file;
+  else {
+    g_debug ("%s failed saving %s file", G_STRFUNC, desktop_file_path);
+    g_free (desktop_file);
+  }
+
+  g_free (desktop_file_path);
+
+  return result;
+}
+
+static gboolean
+install_chrome_app_job (gpointer data, GError **error)
+{
+  ChromeAppInfo *info = (ChromeAppInfo *) data;
+
+  save_chrome_app_icon (info);
+  if (info->icon_data != NULL)
+    prune_icon_store ();
+
+  return write_chrome_app_desktop_file (info, error);
+}
+
+static void
+install_chrome_app_done (gpointer data)
+{
+  ChromeAppInfo *info = (ChromeAppInfo *) data;
+
+  /* Add newly-installed app to Shell's favorites */
+  if (info->desktop_file != NULL)
+    webapp_add_to_favorites (info->desktop_file);
 }
 
 static NPVariant
-uninstall_chrome_app_wrapper (NPObject *object,
-			      const NPVariant *args,
-			      uint32_t argc)
+install_chrome_app_wrapper (NPObject *object,
+			    const NPVariant *args,
+			    uint32_t argc)
 {
   WebappObjectWrapper *wrapper = (WebappObjectWrapper *) object;
   NPVariant result;
-  gchar *app_id, *file_path, *desktop_file;
-  GList *ignored_link = NULL;
+  ChromeAppInfo *info;
+  gchar *app_id;
 
   NULL_TO_NPVARIANT (result);
 
   g_debug ("%s called", G_STRFUNC);
 
-  if (G_UNLIKELY (argc < 1 || !NPVARIANT_IS_STRING (args[0]))) {
-    g_debug ("%s() string expected for argument #1", G_STRFUNC);
+  app_id = variant_to_string (args[0]);
+  if (is_ignored_app (wrapper, app_id)) {
+    /* It's an update for a pre-installed app and we want to ignore it.
+     * This avoids the creation of a desktop file just because a
+     * pre-installed app was updated */
+    g_debug ("%s ignoring %s", G_STRFUNC, app_id);
+    g_free (app_id);
     return result;
   }
 
+  info = g_new0 (ChromeAppInfo, 1);
+  info->app_id = app_id;
+  info->name = variant_to_string (args[1]);
+  info->description = variant_to_string (args[2]);
+  info->icon_data = variant_to_png_data (args[4]);
+
+  queue_job (wrapper, get_callback_argument (args, argc, 5),
+	     install_chrome_app_job, install_chrome_app_done,
+	     info, (GDestroyNotify) chrome_app_info_free);
+
+  return result;
+}
+
+/* Returns the length of the JS array @array, or -1 if it is not one */
+static gint32
+get_array_length (NPP instance, NPObject *array)
+{
+  NPVariant value;
+  gint32 length = 0;
+
+  if (!NPN_GetProperty (instance, array, property_ids[PROPERTY_LENGTH], &value))
+    return -1;
+
+  if (NPVARIANT_IS_INT32 (value))
+    length = NPVARIANT_TO_INT32 (value);
+  else if (NPVARIANT_IS_DOUBLE (value))
+    length = (gint32) NPVARIANT_TO_DOUBLE (value);
+  NPN_ReleaseVariantValue (&value);
+
+  return length;
+}
+
+static gchar *
+get_string_property (NPP instance, NPObject *object, NPIdentifier property)
+{
+  NPVariant value;
+  gchar *s = NULL;
+
+  if (!NPN_GetProperty (instance, object, property, &value))
+    return NULL;
+
+  if (NPVARIANT_IS_STRING (value))
+    s = variant_to_string (value);
+
+  NPN_ReleaseVariantValue (&value);
+
+  return s;
+}
+
+static GBytes *
+get_png_data_property (NPP instance, NPObject *object, NPIdentifier property)
+{
+  NPVariant value;
+  GBytes *data;
+
+  if (!NPN_GetProperty (instance, object, property, &value))
+    return NULL;
+
+  data = variant_to_png_data (value);
+  NPN_ReleaseVariantValue (&value);
+
+  return data;
+}
+
+static gboolean
+install_chrome_apps_job (gpointer data, GError **error)
+{
+  GPtrArray *apps = (GPtrArray *) data;
+  WebappTaskGroup group;
+  gboolean result = TRUE, new_icons = FALSE;
+  guint idx;
+
+  /* Decode and save all icons in parallel. There is one app per ID, so
+   * no two tasks write the same icon */
+  task_group_init (&group);
+  for (idx = 0; idx < apps->len; idx++) {
+    ChromeAppInfo *info = g_ptr_array_index (apps, idx);
+
+    new_icons = new_icons || info->icon_data != NULL;
+    task_group_push (&group, save_chrome_app_icon_func, info);
+  }
+  task_group_wait (&group);
+
+  /* Replaced icons can leave stored ones unused */
+  if (new_icons)
+    prune_icon_store ();
+
+  /* Report the first failure, but still install the remaining apps */
+  for (idx = 0; idx < apps->len; idx++) {
+    if (!write_chrome_app_desktop_file (g_ptr_array_index (apps, idx),
+					result ? error : NULL))
+      result = FALSE;
+  }
+
+  return result;
+}
+
+static void
+install_chrome_apps_done (gpointer data)
+{
+  GPtrArray *apps = (GPtrArray *) data;
+  GPtrArray *favorites;
+  guint idx;
+
+  favorites = g_ptr_array_new ();
+  for (idx = 0; idx < apps->len; idx++) {
+    ChromeAppInfo *info = g_ptr_array_index (apps, idx);
+
+    if (info->desktop_file != NULL)
+      g_ptr_array_add (favorites, info->desktop_file);
+  }
+  g_ptr_array_add (favorites, NULL);
+
+  /* Add all newly-installed apps to Shell's favorites at once */
+  webapp_add_to_favorites_list ((const gchar * const *) favorites->pdata);
+  webapp_flush_favorites ();
+
+  g_ptr_array_free (favorites, TRUE);
+}
+
+static NPVariant
+install_chrome_apps_wrapper (NPObject *object,
+			     const NPVariant *args,
+			     uint32_t argc)
+{
+  WebappObjectWrapper *wrapper = (WebappObjectWrapper *) object;
+  NPVariant result, value;
+  NPObject *array;
+  GPtrArray *apps;
+  GHashTable *app_indexes;
+  gint32 length, i;
+
+  NULL_TO_NPVARIANT (result);
+
+  g_debug ("%s called", G_STRFUNC);
+
+  array = NPVARIANT_TO_OBJECT (args[0]);
+  length = get_array_length (wrapper->instance, array);
+  if (length < 0) {
+    g_debug ("%s() array expected for argument #1", G_STRFUNC);
+    return result;
+  }
+
+  /* Collect all app descriptors first, as NPAPI calls can only be
+   * made from this thread */
+  apps = g_ptr_array_new_with_free_func ((GDestroyNotify) chrome_app_info_free);
+  app_indexes = g_hash_table_new (g_str_hash, g_str_equal);
+  for (i = 0; i < length; i++) {
+    ChromeAppInfo *info;
+    NPObject *app;
+    gpointer idx;
+
+    if (!NPN_GetProperty (wrapper->instance, array, NPN_GetIntIdentifier (i), &value))
+      continue;
+
+    if (!NPVARIANT_IS_OBJECT (value)) {
+      NPN_ReleaseVariantValue (&value);
+      continue;
+    }
+
+    app = NPVARIANT_TO_OBJECT (value);
+
+    info = g_new0 (ChromeAppInfo, 1);
+    info->app_id = get_string_property (wrapper->instance, app, property_ids[PROPERTY_ID]);
+    info->name = get_string_property (wrapper->instance, app, property_ids[PROPERTY_NAME]);
+
+    if (G_UNLIKELY (info->app_id == NULL || info->name == NULL)) {
+      g_debug ("%s app #%d has no id or name", G_STRFUNC, i);
+      chrome_app_info_free (info);
+    } else if (is_ignored_app (wrapper, info->app_id)) {
+      g_debug ("%s ignoring %s (%s)", G_STRFUNC, info->app_id, info->name);
+      chrome_app_info_free (info);
+    } else {
+      info->description = get_string_property (wrapper->instance, app, property_ids[PROPERTY_DESCRIPTION]);
+      info->icon_data = get_png_data_property (wrapper->instance, app, property_ids[PROPERTY_ICON]);
+
+      /* The last descriptor of an app wins */
+      if (g_hash_table_lookup_extended (app_indexes, info->app_id, NULL, &idx)) {
+	ChromeAppInfo *previous = g_ptr_array_index (apps, GPOINTER_TO_UINT (idx));
+
+	g_hash_table_replace (app_indexes, info->app_id, idx);
+	g_ptr_array_index (apps, GPOINTER_TO_UINT (idx)) = info;
+	chrome_app_info_free (previous);
+      } else {
+	g_hash_table_insert (app_indexes, info->app_id, GUINT_TO_POINTER (apps->len));
+	g_ptr_array_add (apps, info);
+      }
+    }
+
+    NPN_ReleaseVariantValue (&value);
+  }
+  g_hash_table_destroy (app_indexes);
+
+  queue_job (wrapper, get_callback_argument (args, argc, 1),
+	     install_chrome_apps_job, install_chrome_apps_done,
+	     apps, (GDestroyNotify) g_ptr_array_unref);
+
+  return result;
+}
+
+static NPVariant
+ignore_chrome_app_wrapper (NPObject *object,
+			   const NPVariant *args,
+			   uint32_t argc)
+{
+  WebappObjectWrapper *wrapper = (WebappObjectWrapper *) object;
+  NPVariant result;
+  gchar *app_id = NULL;
+  gchar *desktop_file_path = NULL;
+
+  NULL_TO_NPVARIANT (result);
+
+  g_debug ("%s called", G_STRFUNC);
+
   app_id = variant_to_string (args[0]);
   if (G_UNLIKELY (app_id == NULL)) {
     g_debug ("%s empty app id", G_STRFUNC);
     return result;
   }
 
-  /* If the user uninstalls a default app, we want not to ignore it any more
-   * in case it's installed again */
-  ignored_link = g_queue_find_custom (wrapper->ignored_desktop_files,
-      app_id, (GCompareFunc) g_strcmp0);
-  if (ignored_link != NULL) {
-    g_debug ("%s removing %s from ignore list", G_STRFUNC, app_id);
-    g_queue_delete_link (wrapper->ignored_desktop_files, ignored_link);
+  desktop_file_path = get_desktop_file_path (app_id, NULL);
+  if (g_file_test (desktop_file_path, G_FILE_TEST_EXISTS)) {
+    /* This app already has a .desktop file installed. We are not going
+     * to ignore feature updates */
+    g_debug ("%s not ignoring app with ID %s", G_STRFUNC, app_id);
+    g_free (app_id);
+  } else {
+    /* This means that the app is a pre-installed  Chrome app and we don't
+     * want to show it on the desktop */
+    g_debug ("%s ignoring installed app with ID %s", G_STRFUNC, app_id);
+    /* Leave ownership of app_id */
+    g_hash_table_add (wrapper->ignored_apps, app_id);
   }
 
-  /* Remove the .desktop file in ~/.local/share/applications */
-  file_path = get_desktop_file_path (app_id, &desktop_file);
-  if (file_path != NULL) {
-    GSettings *settings;
-    gchar **favorite_apps;
-    GPtrArray *apps_array;
+  g_free (desktop_file_path);
 
-    remove_file (file_path);
-    g_free (file_path);
+  return result;
+}
 
-    /* Remove app from Shell's favorites */
-    settings = g_settings_new ("org.gnome.shell");
+static NPVariant
+set_icon_loader_callback_wrapper (NPObject *object,
+				  const NPVariant *args,
+				  uint32_t argc)
+{
+  NPVariant result;
+  NPObject *callback;
 
-    apps_array = g_ptr_array_new ();
-    favorite_apps = g_settings_get_strv (settings, "favorite-apps");
-    if (favorite_apps != NULL) {
-      gboolean changed = FALSE;
-      guint idx;
+  NULL_TO_NPVARIANT (result);
 
-      for (idx = 0; favorite_apps[idx] != NULL; idx++) {
-	if (g_str_equal (desktop_file, favorite_apps[idx])) {
-	  changed = TRUE;
-	  continue;
-	}
+  g_debug ("%s called", G_STRFUNC);
 
-	g_ptr_array_add (apps_array, favorite_apps[idx]);
-      }
+  callback = NPVARIANT_TO_OBJECT (args[0]);
+  webapp_monitor_set_icon_loader_callback (((WebappObjectWrapper *) object)->instance, callback);
+
+  return result;
+}
+
+static NPVariant
+set_ready_callback_wrapper (NPObject *object,
+			    const NPVariant *args,
+			    uint32_t argc)
+{
+  NPVariant result;
+
+  NULL_TO_NPVARIANT (result);
+
+  g_debug ("%s called", G_STRFUNC);
+
+  webapp_monitor_set_ready_callback (((WebappObjectWrapper *) object)->instance,
+				     NPVARIANT_TO_OBJECT (args[0]));
+
+  return result;
+}
+
+typedef struct {
+  gchar *url;
+  /* Still base64 encoded */
+  GBytes *icon_base64;
+
+  /* Largest size installed by the job */
+  gint icon_size;
+} IconForUrlInfo;
+
+static void
+icon_for_url_info_free (IconForUrlInfo *info)
+{
+  g_free (info->url);
+  if (info->icon_base64 != NULL)
+    g_bytes_unref (info->icon_base64);
+  g_free (info);
+}
+
+/* Sizes of the hicolor theme, largest first */
+static const gint hicolor_icon_sizes[] = { 256, 192, 128, 96, 72, 64, 48, 36, 32, 24, 22, 16 };
+
+typedef struct {
+  GdkPixbuf *pixbuf;
+  gint size;
+  gchar *path;
+  GError *error;
+} IconLevel;
+
+static void
+icon_level_free (IconLevel *level)
+{
+  g_object_unref (level->pixbuf);
+  g_free (level->path);
+  if (level->error != NULL)
+    g_error_free (level->error);
+  g_free (level);
+}
+
+static void
+save_icon_level_func (gpointer data, gpointer user_data)
+{
+  IconLevel *level = (IconLevel *) data;
+  gchar *dir_path;
+
+  g_debug ("%s saving icon to %s", G_STRFUNC, level->path);
+
+  dir_path = g_path_get_dirname (level->path);
+  g_mkdir_with_parents (dir_path, 0700);
+  g_free (dir_path);
+
+  gdk_pixbuf_save (level->pixbuf, level->path, "png", &level->error, NULL);
+}
+
+static gboolean
+set_icon_for_url_job (gpointer data, GError **error)
+{
+  IconForUrlInfo *info = (IconForUrlInfo *) data;
+  GdkPixbuf *pixbuf, *previous;
+  GPtrArray *levels;
+  WebappTaskGroup group;
+  gint width;
+  gchar *icon_file;
+  guint first, idx;
+  gboolean result = TRUE;
+
+  if (info->icon_base64 == NULL) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+		 "Icon for %s is not a PNG data URL", info->url);
+    return FALSE;
+  }
+
+  /* Find the .desktop file for the URL */
+  icon_file = webapp_monitor_lookup_icon_for_url (info->url);
+  if (icon_file == NULL) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+		 "No desktop file found for %s", info->url);
+    return FALSE;
+  }
+
+  g_debug ("%s found icon %s for URL %s", G_STRFUNC, icon_file, info->url);
+
+  pixbuf = get_pixbuf_from_base64 (info->icon_base64, error);
+  if (pixbuf == NULL) {
+    g_free (icon_file);
+    return FALSE;
+  }
+
+  /* Install every size not larger than the captured image, or just the
+   * smallest one for tiny images */
+  width = gdk_pixbuf_get_width (pixbuf);
+  for (first = 0; first < G_N_ELEMENTS (hicolor_icon_sizes) - 1; first++) {
+    if (hicolor_icon_sizes[first] <= width)
+      break;
+  }
+
+  /* Each level is scaled down from the previous one, and saved while
+   * the next ones are computed */
+  levels = g_ptr_array_new_with_free_func ((GDestroyNotify) icon_level_free);
+  task_group_init (&group);
+
+  previous = pixbuf;
+  for (idx = first; idx < G_N_ELEMENTS (hicolor_icon_sizes); idx++) {
+    gint size = hicolor_icon_sizes[idx];
+    IconLevel *level;
+    GdkPixbuf *scaled;
+
+    scaled = webapp_icon_scale (previous, size, size);
+    if (scaled == NULL) {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+		   "Could not scale icon for %s", info->url);
+      result = FALSE;
+      break;
+    }
+
+    level = g_new0 (IconLevel, 1);
+    level->pixbuf = scaled;
+    level->size = size;
+    level->path = g_strdup_printf ("%s/.local/share/icons/hicolor/%dx%d/apps/%s.png",
+				   g_get_home_dir (), size, size, icon_file);
+    g_ptr_array_add (levels, level);
+    task_group_push (&group, save_icon_level_func, level);
+
+    previous = scaled;
+  }
+
+  task_group_wait (&group);
+
+  for (idx = 0; idx < levels->len; idx++) {
+    IconLevel *level = g_ptr_array_index (levels, idx);
+
+    if (level->error == NULL)
+      info->icon_size = MAX (info->icon_size, level->size);
+  }
+
+  /* Report the first failure */
+  for (idx = 0; result && idx < levels->len; idx++) {
+    IconLevel *level = g_ptr_array_index (levels, idx);
+
+    if (level->error != NULL) {
+      g_propagate_error (error, level->error);
+      level->error = NULL;
+      result = FALSE;
+    }
+  }
+
+  g_ptr_array_unref (levels);
+  g_object_unref (pixbuf);
+  g_free (icon_file);
+
+  return result;
+}
+
+/* Lets the monitor know the app has a large enough icon now */
+static void
+set_icon_for_url_done (gpointer data)
+{
+  IconForUrlInfo *info = (IconForUrlInfo *) data;
+
+  if (info->icon_size > 0)
+    webapp_monitor_set_icon_size_for_url (info->url, info->icon_size);
+}
+
+static NPVariant
+set_icon_for_url_wrapper (NPObject *object,
+			  const NPVariant *args,
+			  uint32_t argc)
+{
+  WebappObjectWrapper *wrapper = (WebappObjectWrapper *) object;
+  NPVariant result;
+  IconForUrlInfo *info;
+
+  NULL_TO_NPVARIANT (result);
+
+  g_debug ("%s called", G_STRFUNC);
+
+  info = g_new0 (IconForUrlInfo, 1);
+  info->url = variant_to_string (args[0]);
+  info->icon_base64 = variant_to_png_base64 (args[1]);
+
+  /* The browser is done capturing this icon */
+  webapp_monitor_complete_icon_request (info->url);
+
+  queue_job (wrapper, get_callback_argument (args, argc, 2),
+	     set_icon_for_url_job, set_icon_for_url_done,
+	     info, (GDestroyNotify) icon_for_url_info_free);
+
+  return result;
+}
+
+/* The browser has no icon to give for the URL, e.g. because no tab shows
+ * it, so the request need not wait for its timeout */
+static NPVariant
+icon_unavailable_wrapper (NPObject *object,
+			  const NPVariant *args,
+			  uint32_t argc)
+{
+  NPVariant result;
+  gchar *url;
+
+  NULL_TO_NPVARIANT (result);
+
+  url = variant_to_string (args[0]);
+  g_debug ("%s no icon for %s", G_STRFUNC, url);
+
+  webapp_monitor_complete_icon_request (url);
+  g_free (url);
 
-      g_ptr_array_add (apps_array, NULL);
-      if (changed) {
-	g_settings_set_strv (settings, "favorite-apps", (const gchar *const *) apps_array->pdata);
+  return result;
+}
+
+static void
+remove_file (const gchar *path)
+{
+  if (g_unlink (path) != 0)
+    g_debug ("%s could not remove %s", G_STRFUNC, path);
+}
+
+/* Removes the icons named in @icons from all the sizes in the user's
+ * hicolor theme, listing each size directory once */
+static void
+remove_themed_icons (GHashTable *icons)
+{
+  gchar *theme_path;
+  const gchar *size;
+  GDir *theme_dir;
+
+  theme_path = g_build_filename (g_get_home_dir (), ".local/share/icons/hicolor", NULL);
+  theme_dir = g_dir_open (theme_path, 0, NULL);
+  if (theme_dir == NULL) {
+    g_free (theme_path);
+    return;
+  }
+
+  while ((size = g_dir_read_name (theme_dir)) != NULL) {
+    gchar *apps_path;
+    const gchar *name;
+    GDir *apps_dir;
+
+    apps_path = g_build_filename (theme_path, size, "apps", NULL);
+    apps_dir = g_dir_open (apps_path, 0, NULL);
+    if (apps_dir == NULL) {
+      g_free (apps_path);
+      continue;
+    }
+
+    while ((name = g_dir_read_name (apps_dir)) != NULL) {
+      const gchar *dot = strrchr (name, '.');
+      gchar *icon, *path;
+
+      if (dot == NULL || !g_str_has_prefix (name, "chrome-"))
+	continue;
+
+      icon = g_strndup (name, dot - name);
+      if (g_hash_table_contains (icons, icon)) {
+	path = g_build_filename (apps_path, name, NULL);
+	remove_file (path);
+	g_free (path);
       }
+      g_free (icon);
     }
 
-    g_ptr_array_free (apps_array, TRUE);
-    g_object_unref (settings);
+    g_dir_close (apps_dir);
+    g_free (apps_path);
   }
 
-  /* Remove the icon file in ~/.local/share/icons */
-  file_path = g_strdup_printf ("%s/.local/share/icons/chrome-%s.png", g_get_home_dir (), app_id);
-  if (file_path) {
+  g_dir_close (theme_dir);
+  g_free (theme_path);
+}
+
+/* Removes the desktop files and icons of the apps in @data, an array of
+ * ChromeAppInfo */
+static gboolean
+uninstall_chrome_apps_job (gpointer data, GError **error)
+{
+  GPtrArray *apps = (GPtrArray *) data;
+  GHashTable *icons;
+  gchar *file_path;
+  guint idx;
+
+  icons = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  for (idx = 0; idx < apps->len; idx++) {
+    ChromeAppInfo *info = g_ptr_array_index (apps, idx);
+    gchar *icon;
+
+    /* Icons saved by setIconForURL are named after the desktop file's */
+    icon = webapp_monitor_lookup_icon_for_app_id (info->app_id);
+    if (icon != NULL && !g_path_is_absolute (icon))
+      g_hash_table_add (icons, icon);
+    else
+      g_free (icon);
+    g_hash_table_add (icons, g_strdup_printf ("chrome-%s", info->app_id));
+
+    /* Remove the .desktop file in ~/.local/share/applications */
+    file_path = get_desktop_file_path (info->app_id, &info->desktop_file);
+    remove_file (file_path);
+    g_free (file_path);
+
+    /* Remove the icon file in ~/.local/share/icons */
+    file_path = g_strdup_printf ("%s/.local/share/icons/chrome-%s.png", g_get_home_dir (), info->app_id);
     remove_file (file_path);
     g_free (file_path);
   }
 
-  g_free (desktop_file);
-  g_free (app_id);
+  remove_themed_icons (icons);
+  g_hash_table_destroy (icons);
+  prune_icon_store ();
+
+  return TRUE;
+}
+
+static void
+uninstall_chrome_apps_done (gpointer data)
+{
+  GPtrArray *apps = (GPtrArray *) data;
+  GPtrArray *favorites;
+  guint idx;
+
+  favorites = g_ptr_array_new ();
+  for (idx = 0; idx < apps->len; idx++) {
+    ChromeAppInfo *info = g_ptr_array_index (apps, idx);
+
+    if (info->desktop_file != NULL)
+      g_ptr_array_add (favorites, info->desktop_file);
+  }
+  g_ptr_array_add (favorites, NULL);
+
+  /* Remove all apps from Shell's favorites at once */
+  webapp_remove_from_favorites_list ((const gchar * const *) favorites->pdata);
+  webapp_flush_favorites ();
+
+  g_ptr_array_free (favorites, TRUE);
+}
+
+/* Adds an uninstall of @app_id to @apps, taking ownership of @app_id */
+static void
+add_uninstall (WebappObjectWrapper *wrapper, GPtrArray *apps, gchar *app_id)
+{
+  ChromeAppInfo *info;
+
+  info = g_new0 (ChromeAppInfo, 1);
+  info->app_id = app_id;
+
+  /* If the user uninstalls a default app, we want not to ignore it any more
+   * in case it's installed again */
+  if (g_hash_table_remove (wrapper->ignored_apps, app_id))
+    g_debug ("%s removing %s from ignore list", G_STRFUNC, app_id);
+
+  g_ptr_array_add (apps, info);
+}
+
+static NPVariant
+uninstall_chrome_app_wrapper (NPObject *object,
+			      const NPVariant *args,
+			      uint32_t argc)
+{
+  WebappObjectWrapper *wrapper = (WebappObjectWrapper *) object;
+  NPVariant result;
+  GPtrArray *apps;
+
+  NULL_TO_NPVARIANT (result);
+
+  g_debug ("%s called", G_STRFUNC);
+
+  apps = g_ptr_array_new_with_free_func ((GDestroyNotify) chrome_app_info_free);
+  add_uninstall (wrapper, apps, variant_to_string (args[0]));
+
+  queue_job (wrapper, get_callback_argument (args, argc, 1),
+	     uninstall_chrome_apps_job, uninstall_chrome_apps_done,
+	     apps, (GDestroyNotify) g_ptr_array_unref);
+
+  return result;
+}
+
+static NPVariant
+uninstall_chrome_apps_wrapper (NPObject *object,
+			       const NPVariant *args,
+			       uint32_t argc)
+{
+  WebappObjectWrapper *wrapper = (WebappObjectWrapper *) object;
+  NPVariant result, value;
+  NPObject *array;
+  GPtrArray *apps;
+  gint32 length, i;
+
+  NULL_TO_NPVARIANT (result);
+
+  g_debug ("%s called", G_STRFUNC);
+
+  array = NPVARIANT_TO_OBJECT (args[0]);
+  length = get_array_length (wrapper->instance, array);
+  if (length < 0) {
+    g_debug ("%s() array expected for argument #1", G_STRFUNC);
+    return result;
+  }
+
+  apps = g_ptr_array_new_with_free_func ((GDestroyNotify) chrome_app_info_free);
+  for (i = 0; i < length; i++) {
+    if (!NPN_GetProperty (wrapper->instance, array, NPN_GetIntIdentifier (i), &value))
+      continue;
+
+    if (NPVARIANT_IS_STRING (value))
+      add_uninstall (wrapper, apps, variant_to_string (value));
+    else
+      g_debug ("%s app ID #%d is not a string", G_STRFUNC, i);
+
+    NPN_ReleaseVariantValue (&value);
+  }
+
+  queue_job (wrapper, get_callback_argument (args, argc, 1),
+	     uninstall_chrome_apps_job, uninstall_chrome_apps_done,
+	     apps, (GDestroyNotify) g_ptr_array_unref);
 
   return result;
 }
@@ -709,31 +1866,16 @@ uninstall_chrome_app_wrapper (NPObject *object,
 NPObject *
 webapp_create_plugin_object (NPP instance)
 {
-  NPObject *object = NPN_CreateObject (instance, &js_object_class);
-  g_return_val_if_fail (object != NULL, NULL);
+  NPObject *object;
 
   g_debug ("%s()", G_STRFUNC);
 
   g_type_init ();
 
-  WebappObjectWrapper *wrapper = (WebappObjectWrapper *) object;
+  init_method_table ();
 
-  /* Public methods */
-  g_hash_table_insert (wrapper->methods,
-		       (gchar *) "installChromeApp",
-		       install_chrome_app_wrapper);
-  g_hash_table_insert (wrapper->methods,
-		       (gchar *) "uninstallChromeApp",
-		       uninstall_chrome_app_wrapper);
-  g_hash_table_insert (wrapper->methods,
-		       (gchar *) "ignoreChromeApp",
-		       ignore_chrome_app_wrapper);
-  g_hash_table_insert (wrapper->methods,
-		       (gchar *) "setIconLoaderCallback",
-		       set_icon_loader_callback_wrapper);
-  g_hash_table_insert (wrapper->methods,
-		       (gchar *) "setIconForURL",
-		       set_icon_for_url_wrapper);
+  object = NPN_CreateObject (instance, &js_object_class);
+  g_return_val_if_fail (object != NULL, NULL);
 
   return object;
 }
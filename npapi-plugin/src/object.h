@@ -29,5 +29,7 @@
 #include "npapi-headers/headers/npruntime.h"
 
 NPObject *webapp_create_plugin_object (NPP instance);
+void      webapp_detach_jobs (NPP instance);
+void      webapp_shutdown_jobs (void);
 
 #endif
@@ -26,6 +26,7 @@
 
 #include "object.h"
 #include "plugin.h"
+#include "webapp-icon-theme.h"
 #include "webapp-monitor.h"
 #include <glib.h>
 
@@ -101,6 +102,11 @@ NP_GetValue (void *future, NPPVariable aVariable, void *aValue)
 NP_EXPORT(NPError)
 NP_Shutdown (void)
 {
+  webapp_shutdown_jobs ();
+  webapp_flush_favorites ();
+  webapp_shutdown_monitor ();
+  webapp_icon_theme_free ();
+
   return NPERR_NO_ERROR;
 }
 
@@ -128,7 +134,8 @@ NPP_Destroy (NPP instance, NPSavedData **save)
   if (G_UNLIKELY (instance == NULL || instance->pdata == NULL))
     return NPERR_NO_ERROR;
 
-  webapp_destroy_monitor ();
+  webapp_detach_jobs (instance);
+  webapp_destroy_monitor (instance);
 
   TdBrowserPlugin *plugin = instance->pdata;
   g_free (plugin);
@@ -524,3 +531,11 @@ NPN_SetException (NPObject *obj, const NPUTF8 *message)
   g_return_if_fail (browser_funcs != NULL);
   browser_funcs->setexception(obj, message);
 }
+
+void
+NPN_PluginThreadAsyncCall (NPP instance, void (*func) (void *),
+			   void *userData)
+{
+  g_return_if_fail (browser_funcs != NULL);
+  browser_funcs->pluginthreadasynccall(instance, func, userData);
+}
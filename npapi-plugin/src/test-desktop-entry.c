@@ -0,0 +1,402 @@
+/*
+ * This file is part of the desktop-webapp-browser-extension.
+ * Copyright (C) Collabora Ltd. 2013
+ *
+ * Author:
+ *   Rodrigo Moya <rodrigo.moya@collabora.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Checks the desktop file scanner and writer against GKeyFile and
+ * g_shell_parse_argv, which they replace. Run with -m perf to compare
+ * their speed */
+
+#include <string.h>
+#include <glib.h>
+#include "webapp-desktop-entry.h"
+
+#define N_BENCHMARK_FILES 1000
+#define N_BENCHMARK_ROUNDS 20
+#define N_BENCHMARK_WRITES 20000
+
+typedef struct {
+  gchar *url;
+  gchar *app_id;
+  gchar *icon;
+} ParsedEntry;
+
+static void
+parsed_entry_clear (ParsedEntry *parsed)
+{
+  g_free (parsed->url);
+  g_free (parsed->app_id);
+  g_free (parsed->icon);
+}
+
+static gchar *
+find_argument (gchar **args, const gchar *prefix)
+{
+  gint i;
+
+  for (i = 0; args[i] != NULL; i++) {
+    if (g_str_has_prefix (args[i], prefix))
+      return g_strdup (args[i] + strlen (prefix));
+  }
+
+  return NULL;
+}
+
+/* How the monitor used to parse desktop files */
+static void
+parse_with_key_file (const gchar *contents, ParsedEntry *parsed)
+{
+  GKeyFile *key_file;
+  gchar *exec;
+  gchar **args;
+
+  memset (parsed, 0, sizeof (*parsed));
+
+  key_file = g_key_file_new ();
+  g_assert (g_key_file_load_from_data (key_file, contents, -1, G_KEY_FILE_NONE, NULL));
+
+  parsed->icon = g_key_file_get_string (key_file, G_KEY_FILE_DESKTOP_GROUP,
+					G_KEY_FILE_DESKTOP_KEY_ICON, NULL);
+
+  exec = g_key_file_get_string (key_file, G_KEY_FILE_DESKTOP_GROUP,
+				G_KEY_FILE_DESKTOP_KEY_EXEC, NULL);
+  if (exec != NULL && g_shell_parse_argv (exec, NULL, &args, NULL)) {
+    parsed->url = find_argument (args, "--app=");
+    parsed->app_id = find_argument (args, "--app-id=");
+    g_strfreev (args);
+  }
+
+  g_free (exec);
+  g_key_file_free (key_file);
+}
+
+static void
+parse_with_scanner (const gchar *contents, ParsedEntry *parsed)
+{
+  WebappDesktopEntryValues values;
+
+  memset (parsed, 0, sizeof (*parsed));
+
+  g_assert (webapp_desktop_entry_scan (contents, strlen (contents), &values));
+
+  if (values.icon != NULL)
+    parsed->icon = webapp_desktop_entry_unescape (values.icon, values.icon_len);
+
+  if (values.exec != NULL) {
+    parsed->url = webapp_desktop_entry_get_exec_argument (values.exec, values.exec_len, "--app=");
+    parsed->app_id = webapp_desktop_entry_get_exec_argument (values.exec, values.exec_len, "--app-id=");
+  }
+}
+
+static void
+assert_same_parse (const gchar *contents)
+{
+  ParsedEntry expected, parsed;
+
+  parse_with_key_file (contents, &expected);
+  parse_with_scanner (contents, &parsed);
+
+  g_assert_cmpstr (parsed.url, ==, expected.url);
+  g_assert_cmpstr (parsed.app_id, ==, expected.app_id);
+  g_assert_cmpstr (parsed.icon, ==, expected.icon);
+
+  parsed_entry_clear (&expected);
+  parsed_entry_clear (&parsed);
+}
+
+/* Exec values as written in the file, so still key file escaped, and
+ * the --app= argument they hold */
+static const struct {
+  const gchar *exec;
+  const gchar *url;
+} exec_lines[] = {
+  { "chromium-browser --app=http://example.com/", "http://example.com/" },
+  { "google-chrome \"--app-id=abcdefghijklmnop\"", NULL },
+  { "chromium --profile-directory=Default --app-id=abc --app=https://a.example/", "https://a.example/" },
+  { "chromium '--app=http://example.com/a b'", "http://example.com/a b" },
+  { "chromium \"--app=http://example.com/\\\\\"q\\\\\"\"", "http://example.com/\"q\"" },
+  { "chromium --app=http://example.com/a\\sb", "http://example.com/a" },
+  { "chromium --no-app=foo --app=bar", "bar" },
+  { "chromium --app=", "" },
+  { "chromium --app='http://a/'\"b\"c", "http://a/bc" },
+  { "chromium --app=http://a/b\\\\ c", "http://a/b c" },
+  { "chromium \"--app=http://a/\\\\q\"", "http://a/\\q" },
+  { "chromium\t--app=http://a/\t%U", "http://a/" },
+  { "chromium\\t--app=http://a/ %U", "http://a/" },
+  { "chromium '--app=http://a/\\\\b'", "http://a/\\b" },
+  { "chromium --app=\"http://a/ b\" --app=second", "http://a/ b" },
+  { "chromium", NULL }
+};
+
+static void
+test_exec_argument (void)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (exec_lines); i++) {
+    gchar *contents, *url;
+
+    contents = g_strdup_printf ("[Desktop Entry]\nExec=%s\n", exec_lines[i].exec);
+    url = webapp_desktop_entry_get_exec_argument (exec_lines[i].exec, strlen (exec_lines[i].exec), "--app=");
+
+    g_assert_cmpstr (url, ==, exec_lines[i].url);
+    assert_same_parse (contents);
+
+    g_free (url);
+    g_free (contents);
+  }
+}
+
+static const gchar *desktop_files[] = {
+  "#!/usr/bin/env xdg-open\n"
+  "[Desktop Entry]\n"
+  "Version=1.0\n"
+  "Terminal=false\n"
+  "Type=Application\n"
+  "Name=Example\n"
+  "Exec=/opt/google/chrome/google-chrome --profile-directory=Default --app-id=abcdefghijklmnopabcdefghijklmnop\n"
+  "Icon=chrome-abcdefghijklmnopabcdefghijklmnop-Default\n"
+  "StartupWMClass=crx_abcdefghijklmnopabcdefghijklmnop\n",
+
+  "[Desktop Entry]\n"
+  "Name=Example\n"
+  "Exec=chromium --app=http://a/\n"
+  "Icon=\\s/home/user/icon\\\\s.png\n"
+  "\n"
+  "[Desktop Action New]\n"
+  "Exec=chromium --app=http://b/\n"
+  "Icon=other\n",
+
+  "[Desktop Entry]\n"
+  "Exec=chromium --app=http://first/\n"
+  "Exec=chromium --app=http://second/\n",
+
+  "# Comment\n"
+  "\n"
+  "[Desktop Entry]\n"
+  "Exec = chromium --app=http://a/\n"
+  "Icon =  icon\n",
+
+  "[Desktop Entry]\n"
+  "Name=No command line\n"
+};
+
+static void
+test_desktop_file (void)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (desktop_files); i++)
+    assert_same_parse (desktop_files[i]);
+}
+
+static void
+test_no_group (void)
+{
+  WebappDesktopEntryValues values;
+  const gchar *contents = "[Desktop Action New]\nExec=chromium --app=http://a/\n";
+
+  g_assert (!webapp_desktop_entry_scan (contents, strlen (contents), &values));
+}
+
+static void
+test_benchmark (void)
+{
+  gchar *files[N_BENCHMARK_FILES];
+  gdouble key_file_time, scanner_time;
+  guint i, round;
+
+  if (!g_test_perf ())
+    return;
+
+  for (i = 0; i < N_BENCHMARK_FILES; i++)
+    files[i] = g_strdup_printf ("#!/usr/bin/env xdg-open\n"
+				"[Desktop Entry]\n"
+				"Version=1.0\n"
+				"Terminal=false\n"
+				"Type=Application\n"
+				"Name=Example %u\n"
+				"Exec=/opt/google/chrome/google-chrome --profile-directory=Default --app=http://example.com/%u\n"
+				"Icon=chrome-example.com__%u-Default\n"
+				"StartupWMClass=example.com__%u\n", i, i, i, i);
+
+  g_test_timer_start ();
+  for (round = 0; round < N_BENCHMARK_ROUNDS; round++) {
+    for (i = 0; i < N_BENCHMARK_FILES; i++) {
+      ParsedEntry parsed;
+
+      parse_with_key_file (files[i], &parsed);
+      parsed_entry_clear (&parsed);
+    }
+  }
+  key_file_time = g_test_timer_elapsed ();
+
+  g_test_timer_start ();
+  for (round = 0; round < N_BENCHMARK_ROUNDS; round++) {
+    for (i = 0; i < N_BENCHMARK_FILES; i++) {
+      ParsedEntry parsed;
+
+      parse_with_scanner (files[i], &parsed);
+      parsed_entry_clear (&parsed);
+    }
+  }
+  scanner_time = g_test_timer_elapsed ();
+
+  g_test_minimized_result (key_file_time, "GKeyFile + g_shell_parse_argv: %.3f us per file",
+			   key_file_time * 1e6 / (N_BENCHMARK_FILES * N_BENCHMARK_ROUNDS));
+  g_test_minimized_result (scanner_time, "webapp_desktop_entry_scan: %.3f us per file",
+			   scanner_time * 1e6 / (N_BENCHMARK_FILES * N_BENCHMARK_ROUNDS));
+
+  for (i = 0; i < N_BENCHMARK_FILES; i++)
+    g_free (files[i]);
+}
+
+/* How chrome app desktop files used to be written */
+static gchar *
+write_with_key_file (const gchar *app_id, const gchar *name,
+		     const gchar *description, const gchar *icon)
+{
+  const gchar *categories[] = { "Network", "WebBrowser" };
+  GKeyFile *key_file;
+  gchar *exec, *crx_app_id, *contents;
+
+  key_file = g_key_file_new ();
+
+  if (name != NULL) {
+    g_key_file_set_string (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_NAME, name);
+    g_key_file_set_string (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_GENERIC_NAME, name);
+  }
+  if (description != NULL)
+    g_key_file_set_string (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_COMMENT, description);
+
+  exec = g_strdup_printf ("chromium \"--app-id=%s\"", app_id);
+  g_key_file_set_string (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_EXEC, exec);
+  g_free (exec);
+
+  g_key_file_set_boolean (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_TERMINAL, FALSE);
+  g_key_file_set_string_list (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_CATEGORIES, categories, G_N_ELEMENTS (categories));
+  g_key_file_set_string (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_TYPE, G_KEY_FILE_DESKTOP_TYPE_APPLICATION);
+  g_key_file_set_boolean (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_STARTUP_NOTIFY, TRUE);
+
+  crx_app_id = g_strdup_printf ("crx_%s", app_id);
+  g_key_file_set_string (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_STARTUP_WM_CLASS, crx_app_id);
+  g_free (crx_app_id);
+
+  if (icon != NULL)
+    g_key_file_set_string (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_ICON, icon);
+
+  contents = g_key_file_to_data (key_file, NULL, NULL);
+  g_key_file_free (key_file);
+
+  return contents;
+}
+
+static const struct {
+  const gchar *app_id;
+  const gchar *name;
+  const gchar *description;
+  const gchar *icon;
+} chrome_apps[] = {
+  { "abcdefghijklmnopabcdefghijklmnop", "Example", "An example app", "/home/user/.local/share/icons/hicolor/48x48/apps/chrome-abcdefghijklmnopabcdefghijklmnop.png" },
+  { "abcdefghijklmnopabcdefghijklmnop", "Example", NULL, NULL },
+  { "abcdefghijklmnopabcdefghijklmnop", NULL, NULL, "chromium-browser.png" },
+  { "  spaced id", "  Leading spaces", "\t\tLeading tabs", " /tmp/icon with spaces.png" },
+  { "\tid", "Trailing spaces  ", "Inner  spaces", "icon" },
+  { "id\\with\\backslashes", "\\ Backslash then space", "C:\\Apps\\", "\\icon" },
+  { "id\nwith\nnewlines", "\n Newline then space", "Two\nlines\r\n", "\r\ticon" },
+  { "caf\xc3\xa9", "Caf\xc3\xa9 \xe2\x98\x95", " \xc3\xa9t\xc3\xa9", "ic\xc3\xb4ne" },
+  { "", "", "", "" }
+};
+
+static void
+test_write_chrome_app (void)
+{
+  GString *buffer;
+  guint i;
+
+  buffer = g_string_new (NULL);
+
+  for (i = 0; i < G_N_ELEMENTS (chrome_apps); i++) {
+    gchar *expected;
+
+    expected = write_with_key_file (chrome_apps[i].app_id, chrome_apps[i].name,
+				    chrome_apps[i].description, chrome_apps[i].icon);
+
+    g_string_truncate (buffer, 0);
+    webapp_desktop_entry_write_chrome_app (buffer, chrome_apps[i].app_id, chrome_apps[i].name,
+					   chrome_apps[i].description, chrome_apps[i].icon);
+
+    g_assert_cmpstr (buffer->str, ==, expected);
+
+    /* And the scanner reads back what was written */
+    assert_same_parse (buffer->str);
+
+    g_free (expected);
+  }
+
+  g_string_free (buffer, TRUE);
+}
+
+static void
+test_write_benchmark (void)
+{
+  GString *buffer;
+  gdouble key_file_time, template_time;
+  guint i;
+
+  if (!g_test_perf ())
+    return;
+
+  g_test_timer_start ();
+  for (i = 0; i < N_BENCHMARK_WRITES; i++)
+    g_free (write_with_key_file (chrome_apps[0].app_id, chrome_apps[0].name,
+				 chrome_apps[0].description, chrome_apps[0].icon));
+  key_file_time = g_test_timer_elapsed ();
+
+  buffer = g_string_sized_new (512);
+
+  g_test_timer_start ();
+  for (i = 0; i < N_BENCHMARK_WRITES; i++) {
+    g_string_truncate (buffer, 0);
+    webapp_desktop_entry_write_chrome_app (buffer, chrome_apps[0].app_id, chrome_apps[0].name,
+					   chrome_apps[0].description, chrome_apps[0].icon);
+  }
+  template_time = g_test_timer_elapsed ();
+
+  g_test_minimized_result (key_file_time, "GKeyFile: %.3f us per desktop file",
+			   key_file_time * 1e6 / N_BENCHMARK_WRITES);
+  g_test_minimized_result (template_time, "webapp_desktop_entry_write_chrome_app: %.3f us per desktop file",
+			   template_time * 1e6 / N_BENCHMARK_WRITES);
+
+  g_string_free (buffer, TRUE);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/desktop-entry/exec-argument", test_exec_argument);
+  g_test_add_func ("/desktop-entry/desktop-file", test_desktop_file);
+  g_test_add_func ("/desktop-entry/no-group", test_no_group);
+  g_test_add_func ("/desktop-entry/write-chrome-app", test_write_chrome_app);
+  g_test_add_func ("/desktop-entry/benchmark", test_benchmark);
+  g_test_add_func ("/desktop-entry/write-benchmark", test_write_benchmark);
+
+  return g_test_run ();
+}
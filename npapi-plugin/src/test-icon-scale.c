@@ -0,0 +1,307 @@
+/*
+ * This file is part of the desktop-webapp-browser-extension.
+ * Copyright (C) Collabora Ltd. 2013
+ *
+ * Author:
+ *   Rodrigo Moya <rodrigo.moya@collabora.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Checks the SSE2 and AVX2 downscaling kernels against the scalar ones,
+ * and the PNG checks done before installing icons as is. Run with
+ * -m perf to compare the scaler with gdk-pixbuf's */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include "webapp-icon.h"
+
+#define N_BENCHMARK_ROUNDS 10
+
+static const struct {
+  WebappScaleKernel kernel;
+  const gchar *name;
+} vector_kernels[] = {
+  { WEBAPP_SCALE_KERNEL_SSE2, "SSE2" },
+  { WEBAPP_SCALE_KERNEL_AVX2, "AVX2" }
+};
+
+static const struct {
+  gint src_width;
+  gint src_height;
+  gint dest_width;
+  gint dest_height;
+} scale_sizes[] = {
+  { 256, 256, 48, 48 },
+  { 255, 129, 17, 16 },
+  { 64, 64, 64, 64 },
+  { 33, 7, 1, 1 },
+  { 1000, 3, 7, 1 },
+  { 1917, 1003, 256, 256 }
+};
+
+/* Rows are padded, as gdk-pixbuf does */
+static gint
+get_stride (gint width, gint n_channels)
+{
+  return (width * n_channels + 3) & ~3;
+}
+
+static gboolean
+kernel_supported (WebappScaleKernel kernel)
+{
+  const guchar src[4] = { 0 };
+  guchar dest[4];
+
+  return webapp_icon_downscale_full (src, 1, 1, 4, dest, 1, 1, 4, 4, kernel);
+}
+
+static guchar *
+new_random_image (gint width, gint height, gint n_channels)
+{
+  gint stride = get_stride (width, n_channels);
+  guchar *pixels;
+  gint i;
+
+  pixels = g_malloc ((gsize) stride * height);
+  for (i = 0; i < stride * height; i++)
+    pixels[i] = g_test_rand_int_range (0, 256);
+
+  return pixels;
+}
+
+static void
+test_vector_kernels (void)
+{
+  guint k, s;
+  gint n_channels;
+
+  for (k = 0; k < G_N_ELEMENTS (vector_kernels); k++) {
+    if (!kernel_supported (vector_kernels[k].kernel)) {
+      g_test_message ("%s kernels not supported, skipped", vector_kernels[k].name);
+      continue;
+    }
+
+    for (s = 0; s < G_N_ELEMENTS (scale_sizes); s++) {
+      for (n_channels = 3; n_channels <= 4; n_channels++) {
+	gint src_width = scale_sizes[s].src_width, src_height = scale_sizes[s].src_height;
+	gint dest_width = scale_sizes[s].dest_width, dest_height = scale_sizes[s].dest_height;
+	gint dest_stride = get_stride (dest_width, n_channels);
+	guchar *src, *expected, *scaled;
+	gint x, y;
+
+	src = new_random_image (src_width, src_height, n_channels);
+	expected = g_malloc0 ((gsize) dest_stride * dest_height);
+	scaled = g_malloc0 ((gsize) dest_stride * dest_height);
+
+	g_assert (webapp_icon_downscale_full (src, src_width, src_height,
+					      get_stride (src_width, n_channels),
+					      expected, dest_width, dest_height, dest_stride,
+					      n_channels, WEBAPP_SCALE_KERNEL_SCALAR));
+
+	g_assert (webapp_icon_downscale_full (src, src_width, src_height,
+					      get_stride (src_width, n_channels),
+					      scaled, dest_width, dest_height, dest_stride,
+					      n_channels, vector_kernels[k].kernel));
+
+	/* Only float rounding differs */
+	for (y = 0; y < dest_height; y++) {
+	  for (x = 0; x < dest_width * n_channels; x++) {
+	    gint i = y * dest_stride + x;
+
+	    g_assert_cmpint (abs (scaled[i] - expected[i]), <=, 1);
+	  }
+	}
+
+	g_free (src);
+	g_free (expected);
+	g_free (scaled);
+      }
+    }
+  }
+}
+
+/* A plain image must stay the same colour at any size, with any
+ * kernels */
+static void
+test_constant_image (void)
+{
+  const guchar colour[4] = { 200, 100, 50, 128 };
+  const WebappScaleKernel kernels[] = {
+    WEBAPP_SCALE_KERNEL_SCALAR,
+    WEBAPP_SCALE_KERNEL_SSE2,
+    WEBAPP_SCALE_KERNEL_AVX2
+  };
+  guint k, s;
+  gint n_channels;
+
+  for (k = 0; k < G_N_ELEMENTS (kernels); k++) {
+    if (!kernel_supported (kernels[k]))
+      continue;
+
+    for (s = 0; s < G_N_ELEMENTS (scale_sizes); s++) {
+      for (n_channels = 3; n_channels <= 4; n_channels++) {
+	gint src_width = scale_sizes[s].src_width, src_height = scale_sizes[s].src_height;
+	gint dest_width = scale_sizes[s].dest_width, dest_height = scale_sizes[s].dest_height;
+	gint src_stride = get_stride (src_width, n_channels);
+	gint dest_stride = get_stride (dest_width, n_channels);
+	guchar *src, *scaled;
+	gint x, y;
+
+	src = g_malloc0 ((gsize) src_stride * src_height);
+	for (y = 0; y < src_height; y++) {
+	  for (x = 0; x < src_width; x++)
+	    memcpy (src + y * src_stride + x * n_channels, colour, n_channels);
+	}
+	scaled = g_malloc0 ((gsize) dest_stride * dest_height);
+
+	g_assert (webapp_icon_downscale_full (src, src_width, src_height, src_stride,
+					      scaled, dest_width, dest_height, dest_stride,
+					      n_channels, kernels[k]));
+
+	for (y = 0; y < dest_height; y++) {
+	  for (x = 0; x < dest_width; x++)
+	    g_assert (memcmp (scaled + y * dest_stride + x * n_channels, colour, n_channels) == 0);
+	}
+
+	g_free (src);
+	g_free (scaled);
+      }
+    }
+  }
+}
+
+static GdkPixbuf *
+new_random_pixbuf (gint width, gint height)
+{
+  GdkPixbuf *pixbuf;
+  guchar *pixels;
+  gint i, len;
+
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, TRUE, 8, width, height);
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+  len = gdk_pixbuf_get_rowstride (pixbuf) * height;
+  for (i = 0; i < len; i++)
+    pixels[i] = g_test_rand_int_range (0, 256);
+
+  return pixbuf;
+}
+
+/* Times scaling a screenshot sized image to some of the sizes
+ * setIconForURL installs */
+static void
+test_benchmark (void)
+{
+  const gint sizes[] = { 256, 128, 48, 16 };
+  const WebappScaleKernel kernels[] = {
+    WEBAPP_SCALE_KERNEL_SCALAR,
+    WEBAPP_SCALE_KERNEL_SSE2,
+    WEBAPP_SCALE_KERNEL_AVX2
+  };
+  const gchar *kernel_names[] = { "scalar", "SSE2", "AVX2" };
+  GdkPixbuf *pixbuf;
+  gdouble elapsed;
+  guint round, i, k;
+
+  if (!g_test_perf ())
+    return;
+
+  pixbuf = new_random_pixbuf (1917, 1003);
+
+  g_test_timer_start ();
+  for (round = 0; round < N_BENCHMARK_ROUNDS; round++) {
+    for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+      g_object_unref (gdk_pixbuf_scale_simple (pixbuf, sizes[i], sizes[i], GDK_INTERP_BILINEAR));
+  }
+  elapsed = g_test_timer_elapsed ();
+  g_test_minimized_result (elapsed, "gdk_pixbuf_scale_simple, bilinear: %.2f ms",
+			   elapsed * 1000 / N_BENCHMARK_ROUNDS);
+
+  g_test_timer_start ();
+  for (round = 0; round < N_BENCHMARK_ROUNDS; round++) {
+    for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+      g_object_unref (webapp_icon_scale (pixbuf, sizes[i], sizes[i]));
+  }
+  elapsed = g_test_timer_elapsed ();
+  g_test_minimized_result (elapsed, "webapp_icon_scale: %.2f ms",
+			   elapsed * 1000 / N_BENCHMARK_ROUNDS);
+
+  for (k = 0; k < G_N_ELEMENTS (kernels); k++) {
+    guchar *dest;
+
+    if (!kernel_supported (kernels[k]))
+      continue;
+
+    dest = g_malloc (sizes[0] * sizes[0] * 4);
+
+    g_test_timer_start ();
+    for (round = 0; round < N_BENCHMARK_ROUNDS; round++) {
+      for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+	webapp_icon_downscale_full (gdk_pixbuf_get_pixels (pixbuf),
+				    gdk_pixbuf_get_width (pixbuf),
+				    gdk_pixbuf_get_height (pixbuf),
+				    gdk_pixbuf_get_rowstride (pixbuf),
+				    dest, sizes[i], sizes[i], sizes[i] * 4,
+				    4, kernels[k]);
+    }
+    elapsed = g_test_timer_elapsed ();
+
+    g_test_minimized_result (elapsed, "webapp_icon_downscale_full, %s kernels: %.2f ms",
+			     kernel_names[k], elapsed * 1000 / N_BENCHMARK_ROUNDS);
+
+    g_free (dest);
+  }
+
+  g_object_unref (pixbuf);
+}
+
+static void
+test_png_chunks (void)
+{
+  GdkPixbuf *pixbuf;
+  WebappPngHeader header;
+  gchar *data;
+  gsize size;
+
+  pixbuf = new_random_pixbuf (48, 48);
+  g_assert (gdk_pixbuf_save_to_buffer (pixbuf, &data, &size, "png", NULL, NULL));
+  g_object_unref (pixbuf);
+
+  g_assert (webapp_png_parse_header ((const guchar *) data, size, &header));
+  g_assert (webapp_png_check_chunks ((const guchar *) data, size));
+
+  /* Truncated after the header, or in the middle of the last chunk */
+  g_assert (!webapp_png_check_chunks ((const guchar *) data, WEBAPP_PNG_HEADER_SIZE + 10));
+  g_assert (!webapp_png_check_chunks ((const guchar *) data, size - 1));
+
+  /* Corrupted image data */
+  data[size / 2] ^= 0x55;
+  g_assert (!webapp_png_check_chunks ((const guchar *) data, size));
+
+  g_free (data);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/icon-scale/vector-kernels", test_vector_kernels);
+  g_test_add_func ("/icon-scale/constant-image", test_constant_image);
+  g_test_add_func ("/icon-scale/png-chunks", test_png_chunks);
+  g_test_add_func ("/icon-scale/benchmark", test_benchmark);
+
+  return g_test_run ();
+}
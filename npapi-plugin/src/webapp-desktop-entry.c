@@ -0,0 +1,349 @@
+/*
+ * This file is part of the desktop-webapp-browser-extension.
+ * Copyright (C) Collabora Ltd. 2013
+ *
+ * Author:
+ *   Rodrigo Moya <rodrigo.moya@collabora.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Allocation free parsing of the desktop files written by Chrome, reading
+ * only what the plugin needs from them, and writing of the desktop files
+ * installed for chrome apps */
+
+#include <string.h>
+#include "webapp-desktop-entry.h"
+
+static gboolean
+key_equal (const gchar *key, const gchar *key_end, const gchar *name)
+{
+  gsize len = strlen (name);
+
+  return (gsize) (key_end - key) == len && memcmp (key, name, len) == 0;
+}
+
+/* Finds the Exec and Icon values of the [Desktop Entry] group of
+ * @contents in a single pass, without allocating. Returns FALSE if there
+ * is no such group */
+gboolean
+webapp_desktop_entry_scan (const gchar *contents, gsize len, WebappDesktopEntryValues *values)
+{
+  const gchar *p = contents, *end = contents + len;
+  gboolean in_group = FALSE, found_group = FALSE;
+
+  memset (values, 0, sizeof (*values));
+
+  while (p < end) {
+    const gchar *line = p, *line_end, *key_end, *value, *value_end;
+
+    line_end = memchr (p, '\n', end - p);
+    if (line_end == NULL)
+      line_end = end;
+    p = line_end + 1;
+
+    while (line < line_end && g_ascii_isspace (*line))
+      line++;
+    if (line == line_end || *line == '#')
+      continue;
+
+    if (*line == '[') {
+      /* [Desktop Entry] comes first, everything after it is actions */
+      if (in_group)
+	break;
+
+      while (line_end > line && g_ascii_isspace (line_end[-1]))
+	line_end--;
+      in_group = key_equal (line, line_end, "[" G_KEY_FILE_DESKTOP_GROUP "]");
+      found_group = found_group || in_group;
+      continue;
+    }
+
+    if (!in_group)
+      continue;
+
+    key_end = memchr (line, '=', line_end - line);
+    if (key_end == NULL)
+      continue;
+
+    value = key_end + 1;
+    while (key_end > line && g_ascii_isspace (key_end[-1]))
+      key_end--;
+    while (value < line_end && g_ascii_isspace (*value))
+      value++;
+    value_end = line_end;
+    while (value_end > value && g_ascii_isspace (value_end[-1]))
+      value_end--;
+
+    /* Later keys override earlier ones, as in GKeyFile */
+    if (key_equal (line, key_end, G_KEY_FILE_DESKTOP_KEY_EXEC)) {
+      values->exec = value;
+      values->exec_len = value_end - value;
+    } else if (key_equal (line, key_end, G_KEY_FILE_DESKTOP_KEY_ICON)) {
+      values->icon = value;
+      values->icon_len = value_end - value;
+    }
+  }
+
+  return found_group;
+}
+
+/* Decodes the key file escape sequence at *@p, if any, into @c */
+static gboolean
+next_value_char (const gchar **p, const gchar *end, gchar *c)
+{
+  if (*p >= end)
+    return FALSE;
+
+  *c = *(*p)++;
+  if (*c != '\\' || *p >= end)
+    return TRUE;
+
+  switch (**p) {
+  case 's': *c = ' '; break;
+  case 'n': *c = '\n'; break;
+  case 't': *c = '\t'; break;
+  case 'r': *c = '\r'; break;
+  case '\\': *c = '\\'; break;
+  default: return TRUE;
+  }
+  (*p)++;
+
+  return TRUE;
+}
+
+gchar *
+webapp_desktop_entry_unescape (const gchar *value, gsize len)
+{
+  const gchar *end = value + len;
+  gchar *result, *q, c;
+
+  q = result = g_malloc (len + 1);
+  while (next_value_char (&value, end, &c))
+    *q++ = c;
+  *q = '\0';
+
+  return result;
+}
+
+typedef struct {
+  const gchar *prefix;
+  gsize matched;
+  gboolean mismatch;
+  GString *value;
+} WebappArgumentMatch;
+
+static void
+match_argument_char (WebappArgumentMatch *match, gchar c)
+{
+  if (match->mismatch)
+    return;
+
+  if (match->prefix[match->matched] != '\0') {
+    if (c == match->prefix[match->matched])
+      match->matched++;
+    else
+      match->mismatch = TRUE;
+  } else {
+    if (match->value == NULL)
+      match->value = g_string_new (NULL);
+    g_string_append_c (match->value, c);
+  }
+}
+
+/* Returns TRUE once an argument matched */
+static gboolean
+end_argument (WebappArgumentMatch *match)
+{
+  if (!match->mismatch && match->prefix[match->matched] == '\0')
+    return TRUE;
+
+  if (match->value != NULL)
+    g_string_truncate (match->value, 0);
+  match->matched = 0;
+  match->mismatch = FALSE;
+
+  return FALSE;
+}
+
+/* Returns the value of the first "@prefix<value>" argument of the still
+ * escaped Exec line @exec, splitting and unquoting it like
+ * g_shell_parse_argv would, but only allocating the result */
+gchar *
+webapp_desktop_entry_get_exec_argument (const gchar *exec, gsize len, const gchar *prefix)
+{
+  WebappArgumentMatch match = { prefix, 0, FALSE, NULL };
+  const gchar *p = exec, *end = exec + len;
+  gboolean in_argument = FALSE, escaped = FALSE, found = FALSE;
+  gchar quote = '\0', c;
+
+  while (!found && next_value_char (&p, end, &c)) {
+    if (escaped) {
+      escaped = FALSE;
+      if (quote == '"' && strchr ("$`\"\\\n", c) == NULL)
+	match_argument_char (&match, '\\');
+      match_argument_char (&match, c);
+    } else if (quote == '\'') {
+      if (c == '\'')
+	quote = '\0';
+      else
+	match_argument_char (&match, c);
+    } else if (quote == '"') {
+      if (c == '"')
+	quote = '\0';
+      else if (c == '\\')
+	escaped = TRUE;
+      else
+	match_argument_char (&match, c);
+    } else if (c == '\\') {
+      escaped = in_argument = TRUE;
+    } else if (c == '\'' || c == '"') {
+      quote = c;
+      in_argument = TRUE;
+    } else if (g_ascii_isspace (c)) {
+      if (in_argument)
+	found = end_argument (&match);
+      in_argument = FALSE;
+    } else {
+      match_argument_char (&match, c);
+      in_argument = TRUE;
+    }
+  }
+
+  if (!found && in_argument)
+    found = end_argument (&match);
+
+  if (!found) {
+    if (match.value != NULL)
+      g_string_free (match.value, TRUE);
+    return NULL;
+  }
+
+  return match.value != NULL ? g_string_free (match.value, FALSE) : g_strdup ("");
+}
+
+typedef enum {
+  TEMPLATE_FIELD_NONE,
+  TEMPLATE_FIELD_NAME,
+  TEMPLATE_FIELD_DESCRIPTION,
+  TEMPLATE_FIELD_APP_ID,
+  TEMPLATE_FIELD_ICON
+} WebappTemplateField;
+
+/* @leading tells whether the field starts the key's value, which is
+ * where g_key_file_set_string escapes spaces and tabs */
+typedef struct {
+  const gchar *prefix;
+  WebappTemplateField field;
+  gboolean leading;
+  const gchar *suffix;
+} WebappTemplateLine;
+
+/* Desktop file written for chrome apps, laid out as g_key_file_to_data
+ * would. Lines whose field is not set are left out */
+static const WebappTemplateLine desktop_file_template[] = {
+  { "[" G_KEY_FILE_DESKTOP_GROUP "]", TEMPLATE_FIELD_NONE, FALSE, NULL },
+  { G_KEY_FILE_DESKTOP_KEY_NAME "=", TEMPLATE_FIELD_NAME, TRUE, NULL },
+  { G_KEY_FILE_DESKTOP_KEY_GENERIC_NAME "=", TEMPLATE_FIELD_NAME, TRUE, NULL },
+  { G_KEY_FILE_DESKTOP_KEY_COMMENT "=", TEMPLATE_FIELD_DESCRIPTION, TRUE, NULL },
+  { G_KEY_FILE_DESKTOP_KEY_EXEC "=chromium \"--app-id=", TEMPLATE_FIELD_APP_ID, FALSE, "\"" },
+  { G_KEY_FILE_DESKTOP_KEY_TERMINAL "=false", TEMPLATE_FIELD_NONE, FALSE, NULL },
+  { G_KEY_FILE_DESKTOP_KEY_CATEGORIES "=Network;WebBrowser;", TEMPLATE_FIELD_NONE, FALSE, NULL },
+  { G_KEY_FILE_DESKTOP_KEY_TYPE "=" G_KEY_FILE_DESKTOP_TYPE_APPLICATION, TEMPLATE_FIELD_NONE, FALSE, NULL },
+  { G_KEY_FILE_DESKTOP_KEY_STARTUP_NOTIFY "=true", TEMPLATE_FIELD_NONE, FALSE, NULL },
+  { G_KEY_FILE_DESKTOP_KEY_STARTUP_WM_CLASS "=crx_", TEMPLATE_FIELD_APP_ID, FALSE, NULL },
+  { G_KEY_FILE_DESKTOP_KEY_ICON "=", TEMPLATE_FIELD_ICON, TRUE, NULL }
+};
+
+/* Appends @value escaped as g_key_file_set_string does. @leading tells
+ * whether @value starts the key's value, where spaces and tabs are
+ * escaped too */
+static void
+append_escaped_value (GString *buffer, const gchar *value, gboolean leading)
+{
+  const gchar *p;
+
+  for (p = value; *p != '\0'; p++) {
+    switch (*p) {
+    case ' ':
+      if (leading) {
+	g_string_append_len (buffer, "\\s", 2);
+	continue;
+      }
+      break;
+    case '\t':
+      if (leading) {
+	g_string_append_len (buffer, "\\t", 2);
+	continue;
+      }
+      break;
+    case '\n':
+      g_string_append_len (buffer, "\\n", 2);
+      continue;
+    case '\r':
+      g_string_append_len (buffer, "\\r", 2);
+      continue;
+    case '\\':
+      g_string_append_len (buffer, "\\\\", 2);
+      leading = FALSE;
+      continue;
+    }
+
+    g_string_append_c (buffer, *p);
+    leading = FALSE;
+  }
+}
+
+/* Appends the desktop file installed for a chrome app to @buffer. The
+ * result is what g_key_file_to_data gives for the same keys */
+void
+webapp_desktop_entry_write_chrome_app (GString     *buffer,
+				       const gchar *app_id,
+				       const gchar *name,
+				       const gchar *description,
+				       const gchar *icon)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (desktop_file_template); i++) {
+    const WebappTemplateLine *line = &desktop_file_template[i];
+    const gchar *value = NULL;
+
+    switch (line->field) {
+    case TEMPLATE_FIELD_NONE:
+      break;
+    case TEMPLATE_FIELD_NAME:
+      value = name;
+      break;
+    case TEMPLATE_FIELD_DESCRIPTION:
+      value = description;
+      break;
+    case TEMPLATE_FIELD_APP_ID:
+      value = app_id;
+      break;
+    case TEMPLATE_FIELD_ICON:
+      value = icon;
+      break;
+    }
+
+    if (line->field != TEMPLATE_FIELD_NONE && value == NULL)
+      continue;
+
+    g_string_append (buffer, line->prefix);
+    if (value != NULL)
+      append_escaped_value (buffer, value, line->leading);
+    if (line->suffix != NULL)
+      g_string_append (buffer, line->suffix);
+    g_string_append_c (buffer, '\n');
+  }
+}
@@ -0,0 +1,45 @@
+/*
+ * This file is part of the desktop-webapp-browser-extension.
+ * Copyright (C) Collabora Ltd. 2013
+ *
+ * Author:
+ *   Rodrigo Moya <rodrigo.moya@collabora.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WEBAPP_DESKTOP_ENTRY_H
+#define WEBAPP_DESKTOP_ENTRY_H
+
+#include <glib.h>
+
+/* Values of the [Desktop Entry] group as found in the file, still
+ * escaped. They point into the scanned buffer */
+typedef struct {
+  const gchar *exec;
+  gsize exec_len;
+  const gchar *icon;
+  gsize icon_len;
+} WebappDesktopEntryValues;
+
+gboolean  webapp_desktop_entry_scan (const gchar *contents, gsize len, WebappDesktopEntryValues *values);
+gchar    *webapp_desktop_entry_unescape (const gchar *value, gsize len);
+gchar    *webapp_desktop_entry_get_exec_argument (const gchar *exec, gsize len, const gchar *prefix);
+
+void      webapp_desktop_entry_write_chrome_app (GString     *buffer,
+						 const gchar *app_id,
+						 const gchar *name,
+						 const gchar *description,
+						 const gchar *icon);
+
+#endif
@@ -0,0 +1,577 @@
+/*
+ * This file is part of the desktop-webapp-browser-extension.
+ * Copyright (C) Collabora Ltd. 2013
+ *
+ * Author:
+ *   Rodrigo Moya <rodrigo.moya@collabora.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Minimal icon theme lookup, answering which sizes the current icon theme
+ * (and the themes it inherits from, down to hicolor) has an icon in. It
+ * reads the icon-theme.cache files generated by gtk-update-icon-cache
+ * directly, and falls back to listing the theme directories for themes
+ * with no cache or an outdated one. */
+
+#include <string.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include "webapp-icon.h"
+#include "webapp-icon-theme.h"
+
+#define DEFAULT_THEME_NAME "hicolor"
+
+/* How often, in seconds, the caches and directory listings are checked
+ * for changes */
+#define REVALIDATE_INTERVAL 5
+
+#define CACHE_EMPTY_OFFSET 0xffffffff
+
+typedef struct {
+  gchar *name;
+  gint size;
+
+  /* Icon names found in this directory, when walking it */
+  GHashTable *icons;
+  gint64 mtime;
+} WebappThemeDirectory;
+
+typedef struct {
+  gchar *path;
+  gint64 mtime;
+
+  GMappedFile *cache;
+  gint64 cache_mtime;
+
+  /* Per theme directory, only used when there is no valid cache */
+  WebappThemeDirectory *directories;
+} WebappThemeRoot;
+
+typedef struct {
+  gchar *name;
+
+  /* Subdirectories and their sizes, from index.theme */
+  gchar **directory_names;
+  gint *directory_sizes;
+  guint n_directories;
+  GHashTable *directory_index;
+
+  /* The theme directory in each of the icon base directories */
+  GPtrArray *roots;
+} WebappTheme;
+
+static GPtrArray *themes = NULL;
+static gint64 last_check = 0;
+G_LOCK_DEFINE_STATIC (themes);
+
+static guint32
+read_uint32 (const guchar *data, gsize len, guint32 offset)
+{
+  if ((gsize) offset + 4 > len)
+    return CACHE_EMPTY_OFFSET;
+
+  return ((guint32) data[offset] << 24) | ((guint32) data[offset + 1] << 16) |
+    ((guint32) data[offset + 2] << 8) | (guint32) data[offset + 3];
+}
+
+static guint16
+read_uint16 (const guchar *data, gsize len, guint32 offset)
+{
+  if ((gsize) offset + 2 > len)
+    return G_MAXUINT16;
+
+  return ((guint16) data[offset] << 8) | (guint16) data[offset + 1];
+}
+
+/* Returns the NUL terminated string at @offset, or NULL if it runs past
+ * the end of the cache */
+static const gchar *
+read_string (const guchar *data, gsize len, guint32 offset)
+{
+  if (offset >= len || memchr (data + offset, '\0', len - offset) == NULL)
+    return NULL;
+
+  return (const gchar *) data + offset;
+}
+
+/* Same hash as gtk-update-icon-cache */
+static guint32
+icon_name_hash (const gchar *name)
+{
+  const signed char *p = (const signed char *) name;
+  guint32 h = *p;
+
+  if (h != 0) {
+    for (p += 1; *p != '\0'; p++)
+      h = (h << 5) - h + *p;
+  }
+
+  return h;
+}
+
+static gint64
+get_mtime (const gchar *path)
+{
+  struct stat buf;
+
+  if (g_stat (path, &buf) != 0)
+    return -1;
+
+  return buf.st_mtime;
+}
+
+static void
+load_root_cache (WebappThemeRoot *root)
+{
+  const guchar *data;
+  gchar *cache_path;
+  GError *error = NULL;
+
+  if (root->cache != NULL) {
+    g_mapped_file_unref (root->cache);
+    root->cache = NULL;
+  }
+
+  cache_path = g_build_filename (root->path, "icon-theme.cache", NULL);
+  root->cache_mtime = get_mtime (cache_path);
+
+  /* Like GTK, ignore caches older than the theme directory */
+  if (root->cache_mtime < 0 || root->cache_mtime < root->mtime) {
+    g_free (cache_path);
+    return;
+  }
+
+  root->cache = g_mapped_file_new (cache_path, FALSE, &error);
+  if (root->cache == NULL) {
+    g_debug ("%s could not map %s: %s", G_STRFUNC, cache_path, error->message);
+    g_error_free (error);
+    g_free (cache_path);
+    return;
+  }
+
+  data = (const guchar *) g_mapped_file_get_contents (root->cache);
+  if (read_uint16 (data, g_mapped_file_get_length (root->cache), 0) != 1) {
+    g_debug ("%s unsupported cache version in %s", G_STRFUNC, cache_path);
+    g_mapped_file_unref (root->cache);
+    root->cache = NULL;
+  }
+
+  g_free (cache_path);
+}
+
+static void
+walk_directory (WebappThemeRoot *root, WebappThemeDirectory *directory)
+{
+  GDir *dir;
+  const gchar *name;
+  gchar *path;
+
+  if (directory->icons != NULL)
+    g_hash_table_remove_all (directory->icons);
+
+  path = g_build_filename (root->path, directory->name, NULL);
+  directory->mtime = get_mtime (path);
+
+  dir = directory->mtime >= 0 ? g_dir_open (path, 0, NULL) : NULL;
+  if (dir == NULL) {
+    g_free (path);
+    return;
+  }
+
+  if (directory->icons == NULL)
+    directory->icons = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  while ((name = g_dir_read_name (dir)) != NULL) {
+    const gchar *dot;
+
+    dot = strrchr (name, '.');
+    if (dot == NULL ||
+	(strcmp (dot, ".png") != 0 && strcmp (dot, ".svg") != 0 && strcmp (dot, ".xpm") != 0))
+      continue;
+
+    g_hash_table_add (directory->icons, g_strndup (name, dot - name));
+  }
+
+  g_dir_close (dir);
+  g_free (path);
+}
+
+static void
+revalidate_root (WebappTheme *theme, WebappThemeRoot *root)
+{
+  gchar *cache_path;
+  guint i;
+
+  root->mtime = get_mtime (root->path);
+
+  cache_path = g_build_filename (root->path, "icon-theme.cache", NULL);
+  if (root->cache == NULL || get_mtime (cache_path) != root->cache_mtime ||
+      root->cache_mtime < root->mtime)
+    load_root_cache (root);
+  g_free (cache_path);
+
+  if (root->cache != NULL || (root->mtime < 0 && root->directories == NULL))
+    return;
+
+  if (root->directories == NULL) {
+    root->directories = g_new0 (WebappThemeDirectory, theme->n_directories);
+    for (i = 0; i < theme->n_directories; i++) {
+      root->directories[i].name = theme->directory_names[i];
+      root->directories[i].mtime = -1;
+    }
+  }
+
+  /* Only list again the directories that changed */
+  for (i = 0; i < theme->n_directories; i++) {
+    WebappThemeDirectory *directory = &root->directories[i];
+    gchar *path;
+    gint64 mtime;
+
+    path = g_build_filename (root->path, directory->name, NULL);
+    mtime = get_mtime (path);
+    g_free (path);
+
+    if (mtime != directory->mtime || (mtime >= 0 && directory->icons == NULL))
+      walk_directory (root, directory);
+  }
+}
+
+static void
+webapp_theme_root_free (WebappThemeRoot *root, guint n_directories)
+{
+  guint i;
+
+  if (root->directories != NULL) {
+    for (i = 0; i < n_directories; i++) {
+      if (root->directories[i].icons != NULL)
+	g_hash_table_destroy (root->directories[i].icons);
+    }
+    g_free (root->directories);
+  }
+
+  if (root->cache != NULL)
+    g_mapped_file_unref (root->cache);
+
+  g_free (root->path);
+  g_free (root);
+}
+
+static void
+webapp_theme_free (WebappTheme *theme)
+{
+  guint i;
+
+  for (i = 0; i < theme->roots->len; i++)
+    webapp_theme_root_free (g_ptr_array_index (theme->roots, i), theme->n_directories);
+  g_ptr_array_free (theme->roots, TRUE);
+
+  g_hash_table_destroy (theme->directory_index);
+  g_strfreev (theme->directory_names);
+  g_free (theme->directory_sizes);
+  g_free (theme->name);
+  g_free (theme);
+}
+
+/* Base directories icon themes are looked up in, in GTK's order */
+static gchar **
+get_icon_base_dirs (void)
+{
+  const gchar * const *data_dirs;
+  GPtrArray *dirs;
+  guint i;
+
+  dirs = g_ptr_array_new ();
+  g_ptr_array_add (dirs, g_build_filename (g_get_user_data_dir (), "icons", NULL));
+  g_ptr_array_add (dirs, g_build_filename (g_get_home_dir (), ".icons", NULL));
+
+  data_dirs = g_get_system_data_dirs ();
+  for (i = 0; data_dirs[i] != NULL; i++)
+    g_ptr_array_add (dirs, g_build_filename (data_dirs[i], "icons", NULL));
+
+  g_ptr_array_add (dirs, NULL);
+
+  return (gchar **) g_ptr_array_free (dirs, FALSE);
+}
+
+/* Loads the theme called @name from the first index.theme found in
+ * @base_dirs, and returns the themes it inherits from in @inherits */
+static WebappTheme *
+load_theme (const gchar *name, gchar **base_dirs, gchar ***inherits)
+{
+  WebappTheme *theme = NULL;
+  GKeyFile *key_file;
+  guint i;
+
+  *inherits = NULL;
+
+  key_file = g_key_file_new ();
+  for (i = 0; base_dirs[i] != NULL; i++) {
+    gchar *path;
+    gboolean loaded;
+
+    path = g_build_filename (base_dirs[i], name, "index.theme", NULL);
+    loaded = g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, NULL);
+    g_free (path);
+
+    if (loaded)
+      break;
+  }
+
+  if (base_dirs[i] == NULL) {
+    g_debug ("%s no index.theme found for icon theme %s", G_STRFUNC, name);
+    g_key_file_free (key_file);
+    return NULL;
+  }
+
+  theme = g_new0 (WebappTheme, 1);
+  theme->name = g_strdup (name);
+  theme->directory_names = g_key_file_get_string_list (key_file, "Icon Theme", "Directories",
+						       NULL, NULL);
+  if (theme->directory_names == NULL)
+    theme->directory_names = g_new0 (gchar *, 1);
+  theme->n_directories = g_strv_length (theme->directory_names);
+  theme->directory_sizes = g_new0 (gint, theme->n_directories);
+  theme->directory_index = g_hash_table_new (g_str_hash, g_str_equal);
+
+  for (i = 0; i < theme->n_directories; i++) {
+    const gchar *directory = theme->directory_names[i];
+    gchar *type;
+
+    type = g_key_file_get_string (key_file, directory, "Type", NULL);
+    if (g_strcmp0 (type, "Scalable") == 0)
+      theme->directory_sizes[i] = WEBAPP_ICON_MAX_SIZE;
+    else
+      theme->directory_sizes[i] = g_key_file_get_integer (key_file, directory, "Size", NULL);
+    g_free (type);
+
+    g_hash_table_insert (theme->directory_index, (gpointer) directory, GUINT_TO_POINTER (i + 1));
+  }
+
+  theme->roots = g_ptr_array_new ();
+  for (i = 0; base_dirs[i] != NULL; i++) {
+    WebappThemeRoot *root;
+
+    root = g_new0 (WebappThemeRoot, 1);
+    root->path = g_build_filename (base_dirs[i], name, NULL);
+    root->cache_mtime = -1;
+    revalidate_root (theme, root);
+
+    g_ptr_array_add (theme->roots, root);
+  }
+
+  *inherits = g_key_file_get_string_list (key_file, "Icon Theme", "Inherits", NULL, NULL);
+  g_key_file_free (key_file);
+
+  return theme;
+}
+
+static gboolean
+has_theme (const gchar *name)
+{
+  guint i;
+
+  for (i = 0; i < themes->len; i++) {
+    if (strcmp (((WebappTheme *) g_ptr_array_index (themes, i))->name, name) == 0)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+static void
+add_theme (const gchar *name, gchar **base_dirs)
+{
+  WebappTheme *theme;
+  gchar **inherits;
+  guint i;
+
+  if (has_theme (name))
+    return;
+
+  theme = load_theme (name, base_dirs, &inherits);
+  if (theme == NULL)
+    return;
+
+  g_ptr_array_add (themes, theme);
+
+  if (inherits != NULL) {
+    for (i = 0; inherits[i] != NULL; i++)
+      add_theme (inherits[i], base_dirs);
+    g_strfreev (inherits);
+  }
+}
+
+/* The theme set in the desktop settings, as GTK would use it */
+static gchar *
+get_current_theme_name (void)
+{
+  GSettingsSchemaSource *source;
+  GSettingsSchema *schema;
+  GSettings *settings;
+  gchar *name;
+
+  source = g_settings_schema_source_get_default ();
+  schema = source != NULL ? g_settings_schema_source_lookup (source, "org.gnome.desktop.interface", TRUE) : NULL;
+  if (schema == NULL)
+    return g_strdup (DEFAULT_THEME_NAME);
+
+  settings = g_settings_new ("org.gnome.desktop.interface");
+  name = g_settings_get_string (settings, "icon-theme");
+  g_object_unref (settings);
+  g_settings_schema_unref (schema);
+
+  if (name == NULL || *name == '\0') {
+    g_free (name);
+    return g_strdup (DEFAULT_THEME_NAME);
+  }
+
+  return name;
+}
+
+static void
+load_themes (void)
+{
+  gchar **base_dirs;
+  gchar *name;
+
+  themes = g_ptr_array_new_with_free_func ((GDestroyNotify) webapp_theme_free);
+  base_dirs = get_icon_base_dirs ();
+
+  name = get_current_theme_name ();
+  add_theme (name, base_dirs);
+  add_theme (DEFAULT_THEME_NAME, base_dirs);
+
+  g_free (name);
+  g_strfreev (base_dirs);
+
+  last_check = g_get_monotonic_time ();
+}
+
+/* Returns the largest size of @icon_name in the cache of @root */
+static gint
+lookup_in_cache (WebappTheme *theme, WebappThemeRoot *root, const gchar *icon_name)
+{
+  const guchar *data;
+  gsize len;
+  guint32 hash_offset, directory_list_offset, n_buckets, icon_offset;
+  gint max_size = 0;
+
+  data = (const guchar *) g_mapped_file_get_contents (root->cache);
+  len = g_mapped_file_get_length (root->cache);
+
+  hash_offset = read_uint32 (data, len, 4);
+  directory_list_offset = read_uint32 (data, len, 8);
+  n_buckets = read_uint32 (data, len, hash_offset);
+  if (n_buckets == 0 || n_buckets == CACHE_EMPTY_OFFSET)
+    return 0;
+
+  icon_offset = read_uint32 (data, len, hash_offset + 4 + 4 * (icon_name_hash (icon_name) % n_buckets));
+  while (icon_offset != CACHE_EMPTY_OFFSET) {
+    const gchar *name;
+    guint32 image_list_offset, n_images, i;
+
+    name = read_string (data, len, read_uint32 (data, len, icon_offset + 4));
+    if (name == NULL || strcmp (name, icon_name) != 0) {
+      icon_offset = read_uint32 (data, len, icon_offset);
+      continue;
+    }
+
+    image_list_offset = read_uint32 (data, len, icon_offset + 8);
+    n_images = read_uint32 (data, len, image_list_offset);
+    if (n_images == CACHE_EMPTY_OFFSET)
+      break;
+
+    for (i = 0; i < n_images; i++) {
+      const gchar *directory;
+      guint16 directory_index;
+      guint index;
+
+      directory_index = read_uint16 (data, len, image_list_offset + 4 + 8 * i);
+      directory = read_string (data, len,
+			       read_uint32 (data, len, directory_list_offset + 4 + 4 * directory_index));
+      if (directory == NULL)
+	break;
+
+      /* Directories not in index.theme are ignored, as GTK does */
+      index = GPOINTER_TO_UINT (g_hash_table_lookup (theme->directory_index, directory));
+      if (index != 0)
+	max_size = MAX (max_size, theme->directory_sizes[index - 1]);
+    }
+
+    break;
+  }
+
+  return max_size;
+}
+
+/* Returns the largest size @icon_name is available in from the current
+ * icon theme, or 0 if it is not in the theme. Scalable icons count as
+ * WEBAPP_ICON_MAX_SIZE. Can be called from any thread */
+gint
+webapp_icon_theme_get_max_size (const gchar *icon_name)
+{
+  gint64 now;
+  gint max_size = 0;
+  guint i, j, k;
+
+  G_LOCK (themes);
+
+  now = g_get_monotonic_time ();
+  if (themes == NULL) {
+    load_themes ();
+  } else if (now - last_check > REVALIDATE_INTERVAL * G_USEC_PER_SEC) {
+    for (i = 0; i < themes->len; i++) {
+      WebappTheme *theme = g_ptr_array_index (themes, i);
+
+      for (j = 0; j < theme->roots->len; j++)
+	revalidate_root (theme, g_ptr_array_index (theme->roots, j));
+    }
+    last_check = now;
+  }
+
+  for (i = 0; i < themes->len; i++) {
+    WebappTheme *theme = g_ptr_array_index (themes, i);
+
+    for (j = 0; j < theme->roots->len; j++) {
+      WebappThemeRoot *root = g_ptr_array_index (theme->roots, j);
+
+      if (root->cache != NULL) {
+	max_size = MAX (max_size, lookup_in_cache (theme, root, icon_name));
+      } else if (root->directories != NULL) {
+	for (k = 0; k < theme->n_directories; k++) {
+	  if (root->directories[k].icons != NULL &&
+	      g_hash_table_contains (root->directories[k].icons, icon_name))
+	    max_size = MAX (max_size, theme->directory_sizes[k]);
+	}
+      }
+    }
+  }
+
+  G_UNLOCK (themes);
+
+  g_debug ("%s largest size for icon %s is %d", G_STRFUNC, icon_name, max_size);
+
+  return max_size;
+}
+
+void
+webapp_icon_theme_free (void)
+{
+  G_LOCK (themes);
+  if (themes != NULL) {
+    g_ptr_array_free (themes, TRUE);
+    themes = NULL;
+  }
+  G_UNLOCK (themes);
+}
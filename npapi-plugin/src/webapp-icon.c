@@ -0,0 +1,484 @@
+/*
+ * This file is part of the desktop-webapp-browser-extension.
+ * Copyright (C) Collabora Ltd. 2013
+ *
+ * Author:
+ *   Rodrigo Moya <rodrigo.moya@collabora.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "webapp-icon.h"
+
+static const guchar png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+static guint32
+read_uint32_be (const guchar *data)
+{
+  return ((guint32) data[0] << 24) | ((guint32) data[1] << 16) |
+    ((guint32) data[2] << 8) | (guint32) data[3];
+}
+
+/* Parses the PNG signature and IHDR chunk at the start of @data, which
+ * must be at least WEBAPP_PNG_HEADER_SIZE bytes long */
+gboolean
+webapp_png_parse_header (const guchar *data, gsize len, WebappPngHeader *header)
+{
+  if (len < WEBAPP_PNG_HEADER_SIZE)
+    return FALSE;
+
+  if (memcmp (data, png_signature, sizeof (png_signature)) != 0)
+    return FALSE;
+
+  /* IHDR must be the first chunk, and is always 13 bytes long */
+  if (read_uint32_be (data + 8) != 13 || memcmp (data + 12, "IHDR", 4) != 0)
+    return FALSE;
+
+  header->width = read_uint32_be (data + 16);
+  header->height = read_uint32_be (data + 20);
+  header->bit_depth = data[24];
+  header->color_type = data[25];
+  header->interlace = data[28];
+
+  return header->width > 0 && header->height > 0;
+}
+
+static gpointer
+init_crc_table (gpointer data)
+{
+  static guint32 table[256];
+  guint32 n, k, c;
+
+  for (n = 0; n < 256; n++) {
+    c = n;
+    for (k = 0; k < 8; k++)
+      c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    table[n] = c;
+  }
+
+  return table;
+}
+
+/* CRC-32 of @data, as stored at the end of each PNG chunk */
+static guint32
+compute_crc (const guchar *data, gsize len)
+{
+  static GOnce once = G_ONCE_INIT;
+  const guint32 *table = g_once (&once, init_crc_table, NULL);
+  guint32 crc = 0xffffffff;
+  gsize i;
+
+  for (i = 0; i < len; i++)
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+
+  return crc ^ 0xffffffff;
+}
+
+/* Checks that @data, which webapp_png_parse_header accepted, is a whole
+ * PNG file: a sequence of chunks with matching CRCs ending with IEND.
+ * The image data itself is not decoded */
+gboolean
+webapp_png_check_chunks (const guchar *data, gsize len)
+{
+  gsize offset = sizeof (png_signature);
+
+  while (len - offset >= 12) {
+    guint32 length = read_uint32_be (data + offset);
+    const guchar *type = data + offset + 4;
+
+    if (length > len - offset - 12)
+      return FALSE;
+
+    if (compute_crc (type, length + 4) != read_uint32_be (type + 4 + length))
+      return FALSE;
+
+    offset += 12 + length;
+
+    if (memcmp (type, "IEND", 4) == 0)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* Area-averaging downscaler for 8-bit RGB(A) images. Rows are first
+ * summed vertically into a float accumulator, in premultiplied alpha,
+ * then each completed output row is summed horizontally. The per-row
+ * kernels have SSE2 and AVX2 versions, chosen at runtime */
+
+typedef struct {
+  void (*premultiply_row) (const guchar *src, gint n_channels, gfloat *dest, gint width);
+  void (*accumulate_row) (gfloat *acc, const gfloat *row, gfloat weight, gsize n);
+} WebappScaleKernels;
+
+/* Source pixels covered by a destination pixel, with the coverage of
+ * the first and last ones */
+typedef struct {
+  gint first;
+  gint last;
+  gfloat first_weight;
+  gfloat last_weight;
+} WebappScaleSpan;
+
+static void
+premultiply_row_scalar (const guchar *src, gint n_channels, gfloat *dest, gint width)
+{
+  gint x;
+
+  for (x = 0; x < width; x++, src += n_channels, dest += 4) {
+    gfloat alpha = n_channels == 4 ? src[3] : 255.0f;
+    gfloat factor = alpha / 255.0f;
+
+    dest[0] = src[0] * factor;
+    dest[1] = src[1] * factor;
+    dest[2] = src[2] * factor;
+    dest[3] = alpha;
+  }
+}
+
+static void
+accumulate_row_scalar (gfloat *acc, const gfloat *row, gfloat weight, gsize n)
+{
+  gsize i;
+
+  for (i = 0; i < n; i++)
+    acc[i] += row[i] * weight;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WEBAPP_SCALE_X86 1
+#include <immintrin.h>
+
+__attribute__ ((target ("sse2"))) static void
+premultiply_row_sse2 (const guchar *src, gint n_channels, gfloat *dest, gint width)
+{
+  const __m128 alpha_mask = _mm_castsi128_ps (_mm_set_epi32 (-1, 0, 0, 0));
+  const __m128 opaque = _mm_set1_ps (255.0f);
+  const __m128 scale = _mm_set1_ps (1.0f / 255.0f);
+  const __m128i zero = _mm_setzero_si128 ();
+  gint x;
+
+  if (n_channels != 4) {
+    premultiply_row_scalar (src, n_channels, dest, width);
+    return;
+  }
+
+  for (x = 0; x < width; x++, src += 4, dest += 4) {
+    __m128i bytes;
+    __m128 pixel, alpha;
+    gint32 packed;
+
+    memcpy (&packed, src, 4);
+    bytes = _mm_unpacklo_epi16 (_mm_unpacklo_epi8 (_mm_cvtsi32_si128 (packed), zero), zero);
+    pixel = _mm_cvtepi32_ps (bytes);
+
+    /* (a, a, a, 255) / 255 leaves alpha itself unchanged */
+    alpha = _mm_shuffle_ps (pixel, pixel, _MM_SHUFFLE (3, 3, 3, 3));
+    alpha = _mm_or_ps (_mm_andnot_ps (alpha_mask, alpha), _mm_and_ps (alpha_mask, opaque));
+
+    _mm_storeu_ps (dest, _mm_mul_ps (pixel, _mm_mul_ps (alpha, scale)));
+  }
+}
+
+__attribute__ ((target ("sse2"))) static void
+accumulate_row_sse2 (gfloat *acc, const gfloat *row, gfloat weight, gsize n)
+{
+  const __m128 w = _mm_set1_ps (weight);
+  gsize i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    _mm_storeu_ps (acc + i, _mm_add_ps (_mm_loadu_ps (acc + i),
+					_mm_mul_ps (_mm_loadu_ps (row + i), w)));
+
+  accumulate_row_scalar (acc + i, row + i, weight, n - i);
+}
+
+__attribute__ ((target ("avx2"))) static void
+premultiply_row_avx2 (const guchar *src, gint n_channels, gfloat *dest, gint width)
+{
+  const __m256 opaque = _mm256_set1_ps (255.0f);
+  const __m256 scale = _mm256_set1_ps (1.0f / 255.0f);
+  gint x;
+
+  if (n_channels != 4) {
+    premultiply_row_scalar (src, n_channels, dest, width);
+    return;
+  }
+
+  /* Two pixels at a time */
+  for (x = 0; x + 2 <= width; x += 2, src += 8, dest += 8) {
+    __m256 pixels, alpha;
+
+    pixels = _mm256_cvtepi32_ps (_mm256_cvtepu8_epi32 (_mm_loadl_epi64 ((const __m128i *) src)));
+
+    alpha = _mm256_permute_ps (pixels, _MM_SHUFFLE (3, 3, 3, 3));
+    alpha = _mm256_blend_ps (alpha, opaque, 0x88);
+
+    _mm256_storeu_ps (dest, _mm256_mul_ps (pixels, _mm256_mul_ps (alpha, scale)));
+  }
+
+  if (x < width)
+    premultiply_row_scalar (src, n_channels, dest, width - x);
+}
+
+__attribute__ ((target ("avx2"))) static void
+accumulate_row_avx2 (gfloat *acc, const gfloat *row, gfloat weight, gsize n)
+{
+  const __m256 w = _mm256_set1_ps (weight);
+  gsize i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    _mm256_storeu_ps (acc + i, _mm256_add_ps (_mm256_loadu_ps (acc + i),
+					      _mm256_mul_ps (_mm256_loadu_ps (row + i), w)));
+
+  accumulate_row_scalar (acc + i, row + i, weight, n - i);
+}
+#endif
+
+static const WebappScaleKernels scalar_kernels = {
+  premultiply_row_scalar,
+  accumulate_row_scalar
+};
+
+#ifdef WEBAPP_SCALE_X86
+static const WebappScaleKernels sse2_kernels = {
+  premultiply_row_sse2,
+  accumulate_row_sse2
+};
+
+static const WebappScaleKernels avx2_kernels = {
+  premultiply_row_avx2,
+  accumulate_row_avx2
+};
+#endif
+
+static gpointer
+select_scale_kernels (gpointer data)
+{
+#ifdef WEBAPP_SCALE_X86
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    return (gpointer) &avx2_kernels;
+  if (__builtin_cpu_supports ("sse2"))
+    return (gpointer) &sse2_kernels;
+#endif
+
+  return (gpointer) &scalar_kernels;
+}
+
+/* Returns the kernels for @kernel, or NULL if the CPU cannot run them */
+static const WebappScaleKernels *
+get_scale_kernels (WebappScaleKernel kernel)
+{
+  static GOnce once = G_ONCE_INIT;
+
+  switch (kernel) {
+  case WEBAPP_SCALE_KERNEL_AUTO:
+    return g_once (&once, select_scale_kernels, NULL);
+  case WEBAPP_SCALE_KERNEL_SCALAR:
+    return &scalar_kernels;
+#ifdef WEBAPP_SCALE_X86
+  case WEBAPP_SCALE_KERNEL_SSE2:
+    __builtin_cpu_init ();
+    return __builtin_cpu_supports ("sse2") ? &sse2_kernels : NULL;
+  case WEBAPP_SCALE_KERNEL_AVX2:
+    __builtin_cpu_init ();
+    return __builtin_cpu_supports ("avx2") ? &avx2_kernels : NULL;
+#endif
+  default:
+    return NULL;
+  }
+}
+
+/* Computes which source pixels each of the @dest_size destination
+ * pixels covers. Weights are in source pixels, so they add up to
+ * @src_size / @dest_size for each destination pixel */
+static WebappScaleSpan *
+compute_spans (gint src_size, gint dest_size)
+{
+  WebappScaleSpan *spans = g_new (WebappScaleSpan, dest_size);
+  gdouble ratio = (gdouble) src_size / dest_size;
+  gint i;
+
+  for (i = 0; i < dest_size; i++) {
+    gdouble start = i * ratio, end = (i + 1) * ratio;
+    WebappScaleSpan *span = &spans[i];
+
+    span->first = (gint) start;
+    span->last = (gint) end;
+    if (span->last == end || span->last >= src_size)
+      span->last--;
+    if (span->first == span->last) {
+      span->first_weight = span->last_weight = end - start;
+    } else {
+      span->first_weight = span->first + 1 - start;
+      span->last_weight = end - span->last;
+    }
+  }
+
+  return spans;
+}
+
+static gfloat
+span_weight (const WebappScaleSpan *span, gint i)
+{
+  if (i == span->first)
+    return span->first_weight;
+  if (i == span->last)
+    return span->last_weight;
+  return 1.0f;
+}
+
+/* Sums the premultiplied pixels of @row covered by each span */
+static void
+scale_row_horizontally (const gfloat *row, const WebappScaleSpan *spans, gint dest_width, gfloat *dest)
+{
+  gint x, i;
+
+  for (x = 0; x < dest_width; x++, dest += 4) {
+    const WebappScaleSpan *span = &spans[x];
+    gfloat r = 0, g = 0, b = 0, a = 0;
+
+    for (i = span->first; i <= span->last; i++) {
+      gfloat w = span_weight (span, i);
+      const gfloat *p = row + i * 4;
+
+      r += p[0] * w;
+      g += p[1] * w;
+      b += p[2] * w;
+      a += p[3] * w;
+    }
+
+    dest[0] = r;
+    dest[1] = g;
+    dest[2] = b;
+    dest[3] = a;
+  }
+}
+
+static guchar
+clamp_channel (gfloat value)
+{
+  if (value <= 0.0f)
+    return 0;
+  if (value >= 255.0f)
+    return 255;
+  return (guchar) (value + 0.5f);
+}
+
+static void
+unpremultiply_row (const gfloat *row, gfloat scale, gint n_channels, guchar *dest, gint width)
+{
+  gint x;
+
+  for (x = 0; x < width; x++, row += 4, dest += n_channels) {
+    gfloat alpha = row[3] * scale;
+    gfloat factor = alpha > 0.0f ? scale * 255.0f / alpha : 0.0f;
+
+    dest[0] = clamp_channel (row[0] * factor);
+    dest[1] = clamp_channel (row[1] * factor);
+    dest[2] = clamp_channel (row[2] * factor);
+    if (n_channels == 4)
+      dest[3] = clamp_channel (alpha);
+  }
+}
+
+/* Downscales the 8-bit RGB or RGBA image in @src into @dest, averaging
+ * the source pixels each destination pixel covers. Both images have
+ * @n_channels channels, and @dest must not be larger than @src */
+void
+webapp_icon_downscale (const guchar *src, gint src_width, gint src_height, gint src_stride,
+		       guchar *dest, gint dest_width, gint dest_height, gint dest_stride,
+		       gint n_channels)
+{
+  webapp_icon_downscale_full (src, src_width, src_height, src_stride,
+			      dest, dest_width, dest_height, dest_stride,
+			      n_channels, WEBAPP_SCALE_KERNEL_AUTO);
+}
+
+/* Like webapp_icon_downscale, using the per-row kernels given by
+ * @kernel. Returns FALSE, leaving @dest untouched, if the CPU or the
+ * build does not support them */
+gboolean
+webapp_icon_downscale_full (const guchar *src, gint src_width, gint src_height, gint src_stride,
+			    guchar *dest, gint dest_width, gint dest_height, gint dest_stride,
+			    gint n_channels, WebappScaleKernel kernel)
+{
+  const WebappScaleKernels *kernels;
+  WebappScaleSpan *columns, *rows;
+  gfloat *premultiplied, *acc, *scaled, scale;
+  gint x, y;
+
+  g_return_val_if_fail (dest_width <= src_width && dest_height <= src_height, FALSE);
+  g_return_val_if_fail (n_channels == 3 || n_channels == 4, FALSE);
+
+  kernels = get_scale_kernels (kernel);
+  if (kernels == NULL)
+    return FALSE;
+
+  columns = compute_spans (src_width, dest_width);
+  rows = compute_spans (src_height, dest_height);
+  premultiplied = g_new (gfloat, src_width * 4);
+  acc = g_new (gfloat, src_width * 4);
+  scaled = g_new (gfloat, dest_width * 4);
+  scale = ((gfloat) dest_width * dest_height) / ((gfloat) src_width * src_height);
+
+  for (y = 0; y < dest_height; y++) {
+    const WebappScaleSpan *span = &rows[y];
+
+    memset (acc, 0, src_width * 4 * sizeof (gfloat));
+    for (x = span->first; x <= span->last; x++) {
+      kernels->premultiply_row (src + (gsize) x * src_stride, n_channels, premultiplied, src_width);
+      kernels->accumulate_row (acc, premultiplied, span_weight (span, x), (gsize) src_width * 4);
+    }
+
+    scale_row_horizontally (acc, columns, dest_width, scaled);
+    unpremultiply_row (scaled, scale, n_channels, dest + (gsize) y * dest_stride, dest_width);
+  }
+
+  g_free (scaled);
+  g_free (acc);
+  g_free (premultiplied);
+  g_free (rows);
+  g_free (columns);
+
+  return TRUE;
+}
+
+/* Returns @pixbuf scaled to @width x @height. Downscaling uses
+ * webapp_icon_downscale, anything else gdk-pixbuf's bilinear filter */
+GdkPixbuf *
+webapp_icon_scale (GdkPixbuf *pixbuf, gint width, gint height)
+{
+  GdkPixbuf *scaled;
+  gint n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+
+  if (width > gdk_pixbuf_get_width (pixbuf) || height > gdk_pixbuf_get_height (pixbuf) ||
+      gdk_pixbuf_get_colorspace (pixbuf) != GDK_COLORSPACE_RGB ||
+      gdk_pixbuf_get_bits_per_sample (pixbuf) != 8 ||
+      (n_channels != 3 && n_channels != 4))
+    return gdk_pixbuf_scale_simple (pixbuf, width, height, GDK_INTERP_BILINEAR);
+
+  scaled = gdk_pixbuf_new (GDK_COLORSPACE_RGB, gdk_pixbuf_get_has_alpha (pixbuf), 8, width, height);
+  if (scaled == NULL)
+    return NULL;
+
+  webapp_icon_downscale (gdk_pixbuf_get_pixels (pixbuf),
+			 gdk_pixbuf_get_width (pixbuf), gdk_pixbuf_get_height (pixbuf),
+			 gdk_pixbuf_get_rowstride (pixbuf),
+			 gdk_pixbuf_get_pixels (scaled), width, height,
+			 gdk_pixbuf_get_rowstride (scaled), n_channels);
+
+  return scaled;
+}
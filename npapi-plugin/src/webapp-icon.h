@@ -0,0 +1,68 @@
+/*
+ * This file is part of the desktop-webapp-browser-extension.
+ * Copyright (C) Collabora Ltd. 2013
+ *
+ * Author:
+ *   Rodrigo Moya <rodrigo.moya@collabora.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WEBAPP_ICON_H
+#define WEBAPP_ICON_H
+
+#include <glib.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+/* Largest icon size we install, as used by the hicolor theme */
+#define WEBAPP_ICON_MAX_SIZE 256
+
+/* Number of bytes needed to parse the PNG signature and IHDR chunk */
+#define WEBAPP_PNG_HEADER_SIZE 33
+
+typedef enum {
+  WEBAPP_PNG_COLOR_GRAY = 0,
+  WEBAPP_PNG_COLOR_RGB = 2,
+  WEBAPP_PNG_COLOR_PALETTE = 3,
+  WEBAPP_PNG_COLOR_GRAY_ALPHA = 4,
+  WEBAPP_PNG_COLOR_RGBA = 6
+} WebappPngColorType;
+
+typedef struct {
+  guint32 width;
+  guint32 height;
+  guint8 bit_depth;
+  guint8 color_type;
+  guint8 interlace;
+} WebappPngHeader;
+
+/* Per-row kernels used by the downscaler */
+typedef enum {
+  WEBAPP_SCALE_KERNEL_AUTO,
+  WEBAPP_SCALE_KERNEL_SCALAR,
+  WEBAPP_SCALE_KERNEL_SSE2,
+  WEBAPP_SCALE_KERNEL_AVX2
+} WebappScaleKernel;
+
+gboolean   webapp_png_parse_header (const guchar *data, gsize len, WebappPngHeader *header);
+gboolean   webapp_png_check_chunks (const guchar *data, gsize len);
+
+void       webapp_icon_downscale (const guchar *src, gint src_width, gint src_height, gint src_stride,
+				  guchar *dest, gint dest_width, gint dest_height, gint dest_stride,
+				  gint n_channels);
+gboolean   webapp_icon_downscale_full (const guchar *src, gint src_width, gint src_height, gint src_stride,
+				       guchar *dest, gint dest_width, gint dest_height, gint dest_stride,
+				       gint n_channels, WebappScaleKernel kernel);
+GdkPixbuf *webapp_icon_scale (GdkPixbuf *pixbuf, gint width, gint height);
+
+#endif
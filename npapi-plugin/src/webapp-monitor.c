@@ -22,355 +22,1868 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <gio/gio.h>
-#include <gtk/gtk.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include "webapp-desktop-entry.h"
+#include "webapp-icon.h"
+#include "webapp-icon-theme.h"
 #include "webapp-monitor.h"
 
+typedef struct {
+  gchar *path;
+  gchar *url;
+  gchar *app_id;
+  gchar *icon;
+  gint icon_size;
+
+  /* Identity of the file the entry was parsed from, with the mtime in
+   * nanoseconds */
+  guint64 inode;
+  guint64 size;
+  gint64 mtime;
+} WebappIndexEntry;
+
+/* The index is saved to disk between runs, so that unchanged desktop
+ * files don't need to be read again on startup */
+#define INDEX_CACHE_VERSION 2
+#define INDEX_CACHE_TYPE "(uxa(sttxsssi))"
+#define INDEX_CACHE_SAVE_DELAY 5
+
+/* Number of parsed entries the startup scan sends to the main context
+ * at once */
+#define SCAN_BATCH_SIZE 32
+
+/* Time without events after which a changed desktop file is considered
+ * completely written, if no CHANGES_DONE_HINT arrives before */
+#define EVENT_QUIET_PERIOD 250
+
+/* Icon requests to the browser in flight at once, and how long to wait
+ * for each, in seconds. The browser captures the icons of a batch one
+ * after the other */
+#define MAX_ICON_REQUESTS 8
+#define ICON_REQUEST_TIMEOUT 30
+
+/* Milliseconds changes to Shell's favorites are held for */
+#define FAVORITES_FLUSH_DELAY 500
+
+typedef struct _ScanData ScanData;
+
 typedef struct {
   GObject object;
 
   GFileMonitor *file_monitor;
   GFileMonitor *desktop_file_monitor;
+
+  /* Plugin instances using the monitor, most recent first. The monitor
+   * outlives them, so that reloading the page finds it warm */
+  GList *clients;
+
+  /* Index of chrome-* desktop files in ~/.local/share/applications,
+   * by path, by --app= URL and by --app-id= ID. Entries are owned by
+   * the path table */
+  GHashTable *entries;
+  GHashTable *entries_by_url;
+  GHashTable *entries_by_app_id;
+
+  gchar *applications_dir;
+  guint save_cache_id;
+
+  /* mtime of the applications directory before the scan listed it. The
+   * saved index is only known to match the directory as it was then */
+  gint64 dir_mtime;
+
+  /* The initial scan runs in a thread, and the monitor is ready once all
+   * existing desktop files have been indexed */
+  GCancellable *scan_cancellable;
+  ScanData *scan;
+  gboolean ready;
+
+  /* Events for the same desktop file are coalesced, and the file is
+   * only processed once it has been completely written */
+  GHashTable *pending_events;
+
+  /* New files not read completely yet, which still need an icon request
+   * once they are */
+  GHashTable *created_files;
+
+  guint n_events;
+  guint n_events_merged;
+  guint n_events_suppressed;
+  guint n_files_processed;
+
+  /* Requests for better icons to the icon loader callback, by URL. Each
+   * URL is only requested once */
+  GHashTable *icon_requests;
+  GQueue *favorite_icon_queue;
+  GQueue *icon_queue;
+  guint n_icon_requests_in_flight;
+  guint dispatch_icons_id;
+
+  /* Shell's favorites, with the list mirrored in a set and kept up to
+   * date through change notifications. Changes are written in delay
+   * mode and applied together once no more changes came for
+   * FAVORITES_FLUSH_DELAY milliseconds, or when a batch ends */
+  GSettings *favorites_settings;
+  gchar **favorite_apps;
+  GHashTable *favorites;
+  guint favorites_flush_id;
+} WebappMonitor;
+
+/* State of the startup scan, shared with its thread */
+struct _ScanData {
+  WebappMonitor *monitor;
+  GCancellable *cancellable;
+  gchar *applications_dir;
+  gint64 dir_mtime;
+  GThread *thread;
+
+  /* Paths deleted while the scan runs, which its batches must not bring
+   * back. Only used in the main context */
+  GHashTable *deleted;
+
+  GMutex lock;
+  GPtrArray *batch;
+
+  /* Sources the thread added to the main context that did not run yet */
+  GSList *sources;
+};
+
+typedef struct {
+  WebappMonitor *monitor;
+  gchar *path;
+  gboolean created;
+  guint n_events;
+  guint timeout_id;
+} WebappPendingEvent;
+
+typedef struct {
   NPP instance;
   NPObject *icon_loader_callback;
-} WebappMonitor;
+  NPObject *ready_callback;
+} WebappMonitorClient;
+
+typedef enum {
+  ICON_REQUEST_QUEUED,
+  ICON_REQUEST_IN_FLIGHT,
+  ICON_REQUEST_DONE
+} WebappIconRequestState;
+
+typedef struct {
+  WebappMonitor *monitor;
+  gchar *url;
+  WebappIconRequestState state;
+  guint timeout_id;
+
+  /* Instance asked for the icon, while in flight */
+  NPP instance;
+} WebappIconRequest;
 
 typedef struct {
   GObjectClass parent_class;
 } WebappMonitorClass;
 
-G_DEFINE_TYPE(WebappMonitor, webapp_monitor, G_TYPE_OBJECT)
+G_DEFINE_TYPE(WebappMonitor, webapp_monitor, G_TYPE_OBJECT)
+
+static WebappMonitor *the_monitor = NULL;
+
+/* Protects the_monitor and its index, which are looked up from the
+ * plugin's worker threads */
+G_LOCK_DEFINE_STATIC (index);
+
+static void
+webapp_index_entry_free (WebappIndexEntry *entry)
+{
+  g_free (entry->path);
+  g_free (entry->url);
+  g_free (entry->app_id);
+  g_free (entry->icon);
+  g_free (entry);
+}
+
+static gchar *
+get_index_cache_path (void)
+{
+  return g_build_filename (g_get_user_cache_dir (), "desktop-webapp", "desktop-files.cache", NULL);
+}
+
+static gboolean
+stat_file (const gchar *path, guint64 *inode, guint64 *size, gint64 *mtime)
+{
+  struct stat buf;
+
+  if (g_stat (path, &buf) != 0)
+    return FALSE;
+
+  *inode = buf.st_ino;
+  *size = buf.st_size;
+  *mtime = buf.st_mtim.tv_sec * G_GINT64_CONSTANT (1000000000) + buf.st_mtim.tv_nsec;
+
+  return TRUE;
+}
+
+static gchar *
+empty_to_null (const gchar *s)
+{
+  return *s != '\0' ? g_strdup (s) : NULL;
+}
+
+/* Loads the index saved by a previous run. Returns a table of entries
+ * by basename and sets @dir_mtime to the mtime the applications
+ * directory had when it was saved */
+static GHashTable *
+load_index_cache (const gchar *applications_dir, gint64 *dir_mtime)
+{
+  GHashTable *cache;
+  GVariant *variant, *entries;
+  GVariantIter iter;
+  gchar *path, *contents;
+  gsize len;
+  guint32 version;
+  const gchar *name, *url, *app_id, *icon;
+  guint64 inode, size;
+  gint64 mtime;
+  gint32 icon_size;
+
+  path = get_index_cache_path ();
+  if (!g_file_get_contents (path, &contents, &len, NULL)) {
+    g_free (path);
+    return NULL;
+  }
+  g_free (path);
+
+  variant = g_variant_new_from_data (G_VARIANT_TYPE (INDEX_CACHE_TYPE), contents, len,
+				     FALSE, g_free, contents);
+  g_variant_ref_sink (variant);
+
+  g_variant_get (variant, "(ux@a(sttxsssi))", &version, dir_mtime, &entries);
+  if (version != INDEX_CACHE_VERSION) {
+    g_variant_unref (entries);
+    g_variant_unref (variant);
+    return NULL;
+  }
+
+  cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+				 (GDestroyNotify) webapp_index_entry_free);
+
+  g_variant_iter_init (&iter, entries);
+  while (g_variant_iter_next (&iter, "(&sttx&s&s&si)", &name, &inode, &size, &mtime,
+			      &url, &app_id, &icon, &icon_size)) {
+    WebappIndexEntry *entry = g_new0 (WebappIndexEntry, 1);
+
+    entry->path = g_build_filename (applications_dir, name, NULL);
+    entry->url = empty_to_null (url);
+    entry->app_id = empty_to_null (app_id);
+    entry->icon = empty_to_null (icon);
+    entry->icon_size = icon_size;
+    entry->inode = inode;
+    entry->size = size;
+    entry->mtime = mtime;
+
+    g_hash_table_insert (cache, (gpointer) g_basename (entry->path), entry);
+  }
+
+  g_variant_unref (entries);
+  g_variant_unref (variant);
+
+  return cache;
+}
+
+/* The index can only be saved once it is complete, that is once the scan
+ * finished and all the events received were handled */
+static gboolean
+can_save_index_cache (WebappMonitor *monitor)
+{
+  return monitor->ready && g_hash_table_size (monitor->pending_events) == 0;
+}
+
+static void
+save_index_cache (WebappMonitor *monitor)
+{
+  GVariantBuilder builder;
+  GVariant *variant;
+  GHashTableIter iter;
+  WebappIndexEntry *entry;
+  gchar *path, *dir;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sttxsssi)"));
+
+  g_hash_table_iter_init (&iter, monitor->entries);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &entry)) {
+    g_variant_builder_add (&builder, "(sttxsssi)",
+			   g_basename (entry->path),
+			   entry->inode, entry->size, entry->mtime,
+			   entry->url ? entry->url : "",
+			   entry->app_id ? entry->app_id : "",
+			   entry->icon ? entry->icon : "",
+			   entry->icon_size);
+  }
+
+  variant = g_variant_new ("(uxa(sttxsssi))", INDEX_CACHE_VERSION, monitor->dir_mtime, &builder);
+  g_variant_ref_sink (variant);
+
+  path = get_index_cache_path ();
+  dir = g_path_get_dirname (path);
+  g_mkdir_with_parents (dir, 0700);
+
+  if (!g_file_set_contents (path, g_variant_get_data (variant), g_variant_get_size (variant), NULL))
+    g_debug ("Could not save index cache to %s", path);
+
+  g_free (dir);
+  g_free (path);
+  g_variant_unref (variant);
+}
+
+static gboolean
+save_index_cache_cb (gpointer user_data)
+{
+  WebappMonitor *monitor = (WebappMonitor *) user_data;
+
+  /* Try again later */
+  if (!can_save_index_cache (monitor))
+    return TRUE;
+
+  monitor->save_cache_id = 0;
+  save_index_cache (monitor);
+
+  return FALSE;
+}
+
+static void
+schedule_save_index_cache (WebappMonitor *monitor)
+{
+  if (monitor->save_cache_id == 0) {
+    monitor->save_cache_id = g_timeout_add_seconds (INDEX_CACHE_SAVE_DELAY,
+						    save_index_cache_cb, monitor);
+  }
+}
+
+static void
+webapp_monitor_client_free (WebappMonitorClient *client)
+{
+  if (client->icon_loader_callback != NULL)
+    NPN_ReleaseObject (client->icon_loader_callback);
+  if (client->ready_callback != NULL)
+    NPN_ReleaseObject (client->ready_callback);
+
+  g_free (client);
+}
+
+static WebappMonitorClient *
+find_client (WebappMonitor *monitor, NPP instance)
+{
+  GList *l;
+
+  for (l = monitor->clients; l != NULL; l = l->next) {
+    WebappMonitorClient *client = l->data;
+
+    if (client->instance == instance)
+      return client;
+  }
+
+  return NULL;
+}
+
+/* Icons are requested from the most recent instance able to load them */
+static WebappMonitorClient *
+get_icon_loader_client (WebappMonitor *monitor)
+{
+  GList *l;
+
+  for (l = monitor->clients; l != NULL; l = l->next) {
+    WebappMonitorClient *client = l->data;
+
+    if (client->icon_loader_callback != NULL)
+      return client;
+  }
+
+  return NULL;
+}
+
+static void stop_scan (WebappMonitor *monitor);
+
+static void
+webapp_monitor_finalize (GObject *object)
+{
+  WebappMonitor *monitor = (WebappMonitor *) object;
+
+  stop_scan (monitor);
+
+  g_clear_object (&monitor->file_monitor);
+  g_clear_object (&monitor->desktop_file_monitor);
+
+  g_hash_table_destroy (monitor->pending_events);
+  g_hash_table_destroy (monitor->created_files);
+
+  if (monitor->dispatch_icons_id != 0)
+    g_source_remove (monitor->dispatch_icons_id);
+  g_queue_free (monitor->favorite_icon_queue);
+  g_queue_free (monitor->icon_queue);
+  g_hash_table_destroy (monitor->icon_requests);
+
+  if (monitor->favorites_flush_id != 0) {
+    g_source_remove (monitor->favorites_flush_id);
+    g_settings_apply (monitor->favorites_settings);
+    /* Make sure the write reaches dconf before the plugin is unloaded */
+    g_settings_sync ();
+  }
+  g_signal_handlers_disconnect_by_data (monitor->favorites_settings, monitor);
+  g_object_unref (monitor->favorites_settings);
+  g_hash_table_destroy (monitor->favorites);
+  g_strfreev (monitor->favorite_apps);
+
+  /* Otherwise the cache saved before is kept, and the next scan lists
+   * the directory if it changed since */
+  if (monitor->save_cache_id != 0) {
+    g_source_remove (monitor->save_cache_id);
+    if (can_save_index_cache (monitor))
+      save_index_cache (monitor);
+  }
+
+  g_free (monitor->applications_dir);
+  g_clear_object (&monitor->scan_cancellable);
+
+  g_hash_table_destroy (monitor->entries_by_url);
+  g_hash_table_destroy (monitor->entries_by_app_id);
+  g_hash_table_destroy (monitor->entries);
+
+  g_list_free_full (monitor->clients, (GDestroyNotify) webapp_monitor_client_free);
+
+  G_OBJECT_CLASS (webapp_monitor_parent_class)->finalize (object);
+}
+
+static void
+webapp_monitor_class_init (WebappMonitorClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = webapp_monitor_finalize;
+}
+
+typedef struct {
+  gint64 mtime;
+  gint size;
+} WebappIconSize;
+
+/* Probed icon file sizes by path, for files with the given mtime */
+static GHashTable *icon_sizes = NULL;
+G_LOCK_DEFINE_STATIC (icon_sizes);
+
+/* Reads the size of a PNG icon from its IHDR chunk */
+static gboolean
+probe_png_size (const gchar *path, gint *width, gint *height)
+{
+  WebappPngHeader header;
+  guchar data[WEBAPP_PNG_HEADER_SIZE];
+  FILE *file;
+  gboolean result;
+
+  file = g_fopen (path, "rb");
+  if (file == NULL)
+    return FALSE;
+
+  result = fread (data, 1, sizeof (data), file) == sizeof (data) &&
+	   webapp_png_parse_header (data, sizeof (data), &header);
+  fclose (file);
+
+  if (result) {
+    *width = header.width;
+    *height = header.height;
+  }
+
+  return result;
+}
+
+/* Returns the size of the icon at @path, reading only its header. Can be
+ * called from any thread */
+static gint
+get_icon_file_size (const gchar *path)
+{
+  WebappIconSize *cached;
+  guint64 inode, file_size;
+  gint64 mtime;
+  gint width, height, icon_size;
+
+  if (!stat_file (path, &inode, &file_size, &mtime)) {
+    g_debug ("Could not stat icon %s", path);
+    return 0;
+  }
+
+  G_LOCK (icon_sizes);
+  if (icon_sizes != NULL &&
+      (cached = g_hash_table_lookup (icon_sizes, path)) != NULL &&
+      cached->mtime == mtime) {
+    icon_size = cached->size;
+    G_UNLOCK (icon_sizes);
+    return icon_size;
+  }
+  G_UNLOCK (icon_sizes);
+
+  if (!probe_png_size (path, &width, &height) &&
+      gdk_pixbuf_get_file_info (path, &width, &height) == NULL) {
+    g_debug ("Could not load icon %s", path);
+    return 0;
+  }
+
+  icon_size = MIN (width, height);
+
+  G_LOCK (icon_sizes);
+  if (G_UNLIKELY (icon_sizes == NULL))
+    icon_sizes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  cached = g_new (WebappIconSize, 1);
+  cached->mtime = mtime;
+  cached->size = icon_size;
+  g_hash_table_insert (icon_sizes, g_strdup (path), cached);
+  G_UNLOCK (icon_sizes);
+
+  return icon_size;
+}
+
+static void
+unindex_desktop_file (WebappMonitor *monitor, const gchar *path)
+{
+  WebappIndexEntry *entry;
+
+  entry = g_hash_table_lookup (monitor->entries, path);
+  if (entry == NULL)
+    return;
+
+  if (entry->url != NULL && g_hash_table_lookup (monitor->entries_by_url, entry->url) == entry)
+    g_hash_table_remove (monitor->entries_by_url, entry->url);
+  if (entry->app_id != NULL && g_hash_table_lookup (monitor->entries_by_app_id, entry->app_id) == entry)
+    g_hash_table_remove (monitor->entries_by_app_id, entry->app_id);
+
+  g_hash_table_remove (monitor->entries, path);
+}
+
+static void
+insert_index_entry (WebappMonitor *monitor, WebappIndexEntry *entry)
+{
+  G_LOCK (index);
+
+  unindex_desktop_file (monitor, entry->path);
+
+  g_hash_table_insert (monitor->entries, entry->path, entry);
+  if (entry->url != NULL)
+    g_hash_table_insert (monitor->entries_by_url, entry->url, entry);
+  if (entry->app_id != NULL)
+    g_hash_table_insert (monitor->entries_by_app_id, entry->app_id, entry);
+
+  G_UNLOCK (index);
+}
+
+/* Workaround for https://code.google.com/p/chromium/issues/detail?id=247574
+ * Chrome wrote shortcuts running its internal binary rather than the
+ * wrapper script that sets up its environment.
+ * TODO: drop this hack when we no longer support Chrome << 29
+ */
+typedef struct {
+  const gchar *program;
+  gsize program_len;
+  const gchar *replacement;
+  gsize replacement_len;
+} WebappExecRule;
+
+#define EXEC_RULE(program, replacement) \
+  { program, sizeof (program) - 1, replacement, sizeof (replacement) - 1 }
+
+static const WebappExecRule exec_rules[] = {
+  EXEC_RULE ("/opt/google/chrome/chrome", "/opt/google/chrome/google-chrome"),
+  EXEC_RULE ("/opt/google/chrome-beta/chrome", "/opt/google/chrome-beta/google-chrome-beta"),
+  EXEC_RULE ("/opt/google/chrome-unstable/chrome", "/opt/google/chrome-unstable/google-chrome-unstable")
+};
+
+/* Applies the first of exec_rules matching the program run by the Exec
+ * line of @contents. Returns TRUE if @contents was changed */
+static gboolean
+rewrite_exec_line (gchar **contents, gsize *len)
+{
+  WebappDesktopEntryValues values;
+  const WebappExecRule *rule = NULL;
+  gchar *new_contents;
+  gsize offset, tail;
+  guint i;
+
+  if (!webapp_desktop_entry_scan (*contents, *len, &values) || values.exec == NULL)
+    return FALSE;
+
+  for (i = 0; i < G_N_ELEMENTS (exec_rules); i++) {
+    if (values.exec_len >= exec_rules[i].program_len &&
+	memcmp (values.exec, exec_rules[i].program, exec_rules[i].program_len) == 0 &&
+	(values.exec_len == exec_rules[i].program_len ||
+	 g_ascii_isspace (values.exec[exec_rules[i].program_len]))) {
+      rule = &exec_rules[i];
+      break;
+    }
+  }
+
+  if (rule == NULL)
+    return FALSE;
+
+  g_debug ("New desktop file has wrong Exec line, amending it");
+
+  offset = values.exec - *contents;
+  tail = *len - offset - rule->program_len;
+
+  new_contents = g_malloc (offset + rule->replacement_len + tail + 1);
+  memcpy (new_contents, *contents, offset);
+  memcpy (new_contents + offset, rule->replacement, rule->replacement_len);
+  memcpy (new_contents + offset + rule->replacement_len,
+	  *contents + offset + rule->program_len, tail);
+  new_contents[offset + rule->replacement_len + tail] = '\0';
+
+  g_free (*contents);
+  *contents = new_contents;
+  *len = offset + rule->replacement_len + tail;
+
+  return TRUE;
+}
+
+/* Returns a new index entry with the Exec URL/app ID and Icon of the
+ * desktop file at @path with @contents. Can be called from any thread */
+static WebappIndexEntry *
+parse_desktop_data (const gchar *path, const gchar *contents, gsize len)
+{
+  WebappDesktopEntryValues values;
+  WebappIndexEntry *entry;
+
+  if (!webapp_desktop_entry_scan (contents, len, &values)) {
+    g_warning ("Could not parse desktop file %s: no %s group", path, G_KEY_FILE_DESKTOP_GROUP);
+    return NULL;
+  }
+
+  entry = g_new0 (WebappIndexEntry, 1);
+  entry->path = g_strdup (path);
+
+  if (values.icon == NULL) {
+    entry->icon_size = 0;
+  } else {
+    entry->icon = webapp_desktop_entry_unescape (values.icon, values.icon_len);
+    if (g_path_is_absolute (entry->icon))
+      entry->icon_size = get_icon_file_size (entry->icon);
+    else
+      entry->icon_size = webapp_icon_theme_get_max_size (entry->icon);
+  }
+
+  if (values.exec != NULL) {
+    g_debug ("Parsing command line %.*s", (gint) values.exec_len, values.exec);
+
+    entry->url = webapp_desktop_entry_get_exec_argument (values.exec, values.exec_len, "--app=");
+    entry->app_id = webapp_desktop_entry_get_exec_argument (values.exec, values.exec_len, "--app-id=");
+  }
+
+  return entry;
+}
+
+/* Files written by the plugin itself into the applications directory,
+ * by path. The file monitor events these writes cause are recognised
+ * from the file's inode, size and mtime and dropped without reading the
+ * file again. Writes can happen from any thread */
+typedef struct {
+  guint serial;
+  gchar *checksum;
+
+  /* Identity of the file once written. Unknown while the write is in
+   * progress, which happens without holding the lock */
+  gboolean written;
+  guint64 inode;
+  guint64 size;
+  gint64 mtime;
+
+  /* Parsed contents, to be indexed when the write's events arrive */
+  WebappIndexEntry *entry;
+} WebappSelfWrite;
+
+static GHashTable *self_writes = NULL;
+static guint self_write_serial = 0;
+G_LOCK_DEFINE_STATIC (self_writes);
+
+static void
+webapp_self_write_free (WebappSelfWrite *self_write)
+{
+  if (self_write->entry != NULL)
+    webapp_index_entry_free (self_write->entry);
+
+  g_free (self_write->checksum);
+  g_free (self_write);
+}
+
+/* Writes @contents to @path and records the write. @entry, if any, is
+ * added to the index when the write is seen by the file monitor */
+static gboolean
+write_desktop_file (const gchar *path, const gchar *contents, gsize len,
+		    WebappIndexEntry *entry, GError **error)
+{
+  WebappSelfWrite *self_write;
+  guint64 inode, size;
+  gint64 mtime;
+  gchar *checksum;
+  guint serial;
+  gboolean result, written;
+
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, contents, len);
+
+  G_LOCK (self_writes);
+
+  if (G_UNLIKELY (self_writes == NULL)) {
+    self_writes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+					 (GDestroyNotify) webapp_self_write_free);
+  }
+
+  /* Skip the write if we already wrote the same contents and nobody
+   * changed the file since */
+  self_write = g_hash_table_lookup (self_writes, path);
+  if (self_write != NULL && self_write->written &&
+      g_str_equal (self_write->checksum, checksum) &&
+      stat_file (path, &inode, &size, &mtime) &&
+      self_write->inode == inode && self_write->size == size && self_write->mtime == mtime) {
+    G_UNLOCK (self_writes);
+
+    g_debug ("%s %s unchanged, not writing it", G_STRFUNC, path);
+    g_free (checksum);
+    if (entry != NULL)
+      webapp_index_entry_free (entry);
+
+    return TRUE;
+  }
+
+  /* Register the write before doing it, and do it without the lock, which
+   * the main thread takes on every file monitor event */
+  self_write = g_new0 (WebappSelfWrite, 1);
+  self_write->serial = serial = ++self_write_serial;
+  self_write->checksum = checksum;
+  self_write->entry = entry;
+  g_hash_table_insert (self_writes, g_strdup (path), self_write);
+
+  G_UNLOCK (self_writes);
+
+  result = g_file_set_contents (path, contents, len, error);
+  written = result && stat_file (path, &inode, &size, &mtime);
+
+  G_LOCK (self_writes);
+
+  /* Unless another write or a removal replaced it meanwhile */
+  self_write = g_hash_table_lookup (self_writes, path);
+  if (self_write != NULL && self_write->serial == serial) {
+    if (written) {
+      self_write->written = TRUE;
+      self_write->inode = inode;
+      self_write->size = size;
+      self_write->mtime = mtime;
+      if (self_write->entry != NULL) {
+	self_write->entry->inode = inode;
+	self_write->entry->size = size;
+	self_write->entry->mtime = mtime;
+      }
+    } else {
+      /* Let the monitor read it back then */
+      g_hash_table_remove (self_writes, path);
+    }
+  }
+
+  G_UNLOCK (self_writes);
+
+  return result;
+}
+
+/* Writes a desktop file into the applications directory, without the
+ * monitor reading it back. Can be called from any thread */
+gboolean
+webapp_monitor_write_desktop_file (const gchar *path, const gchar *contents,
+				   gssize len, GError **error)
+{
+  if (len < 0)
+    len = strlen (contents);
+
+  return write_desktop_file (path, contents, len,
+			     parse_desktop_data (path, contents, len), error);
+}
+
+/* Whether the current version of @path was written by the plugin. If so,
+ * returns in @entry its parsed contents if they are still to be indexed */
+static gboolean
+is_self_write (const gchar *path, WebappIndexEntry **entry)
+{
+  WebappSelfWrite *self_write;
+  guint64 inode, size;
+  gint64 mtime;
+  gboolean result = FALSE;
+
+  *entry = NULL;
+
+  G_LOCK (self_writes);
+
+  /* Events arriving while the write is still in progress are handled as
+   * anybody else's, keeping the record for later ones */
+  if (self_writes != NULL &&
+      (self_write = g_hash_table_lookup (self_writes, path)) != NULL &&
+      self_write->written) {
+    if (stat_file (path, &inode, &size, &mtime) &&
+	self_write->inode == inode && self_write->size == size && self_write->mtime == mtime) {
+      *entry = self_write->entry;
+      self_write->entry = NULL;
+      result = TRUE;
+    } else {
+      /* Changed by someone else */
+      g_hash_table_remove (self_writes, path);
+    }
+  }
+
+  G_UNLOCK (self_writes);
+
+  return result;
+}
+
+static void
+forget_self_write (const gchar *path)
+{
+  G_LOCK (self_writes);
+  if (self_writes != NULL)
+    g_hash_table_remove (self_writes, path);
+  G_UNLOCK (self_writes);
+}
+
+/* Reads the desktop file at @path, fixing up its Exec line if needed, and
+ * returns a new index entry for it. Can be called from any thread */
+static WebappIndexEntry *
+parse_desktop_file (const gchar *path)
+{
+  WebappIndexEntry *entry;
+  GError *error = NULL;
+  gchar *contents;
+  gsize len;
+
+  if (!g_file_get_contents (path, &contents, &len, &error)) {
+    g_warning ("Could not read %s file: %s", path, error->message);
+    g_error_free (error);
+    return NULL;
+  }
+
+  g_debug ("Old contents = %s\n", contents);
+
+  if (rewrite_exec_line (&contents, &len)) {
+    if (!write_desktop_file (path, contents, len, NULL, &error)) {
+      g_warning ("Could not write %s file: %s", path, error->message);
+      g_clear_error (&error);
+    } else {
+      g_debug ("New contents: %s\n", contents);
+    }
+  }
+
+  entry = parse_desktop_data (path, contents, len);
+
+  /* Done after any rewrite of the file, so the cache matches the file
+   * as it is on disk */
+  if (entry != NULL)
+    stat_file (path, &entry->inode, &entry->size, &entry->mtime);
+
+  g_free (contents);
+
+  return entry;
+}
+
+static void
+webapp_icon_request_free (WebappIconRequest *request)
+{
+  if (request->timeout_id != 0)
+    g_source_remove (request->timeout_id);
+
+  g_free (request->url);
+  g_free (request);
+}
+
+static void
+refresh_favorites (WebappMonitor *monitor)
+{
+  guint idx;
+
+  g_strfreev (monitor->favorite_apps);
+  monitor->favorite_apps = g_settings_get_strv (monitor->favorites_settings, "favorite-apps");
+
+  g_hash_table_remove_all (monitor->favorites);
+  for (idx = 0; monitor->favorite_apps[idx] != NULL; idx++)
+    g_hash_table_add (monitor->favorites, monitor->favorite_apps[idx]);
+}
+
+static void
+on_favorites_changed (GSettings *settings, const gchar *key, gpointer user_data)
+{
+  refresh_favorites ((WebappMonitor *) user_data);
+}
+
+static gboolean
+flush_favorites_cb (gpointer user_data)
+{
+  WebappMonitor *monitor = (WebappMonitor *) user_data;
+
+  monitor->favorites_flush_id = 0;
+
+  g_debug ("%s applying favorites", G_STRFUNC);
+  g_settings_apply (monitor->favorites_settings);
+
+  return FALSE;
+}
+
+static void
+set_favorites (WebappMonitor *monitor, const gchar * const *favorite_apps)
+{
+  g_settings_set_strv (monitor->favorites_settings, "favorite-apps", favorite_apps);
+  refresh_favorites (monitor);
+
+  if (monitor->favorites_flush_id != 0)
+    g_source_remove (monitor->favorites_flush_id);
+  monitor->favorites_flush_id = g_timeout_add (FAVORITES_FLUSH_DELAY, flush_favorites_cb, monitor);
+}
+
+/* Writes any pending change to Shell's favorites, waiting for it to be
+ * stored */
+void
+webapp_flush_favorites (void)
+{
+  if (the_monitor == NULL || the_monitor->favorites_flush_id == 0)
+    return;
+
+  g_source_remove (the_monitor->favorites_flush_id);
+  flush_favorites_cb (the_monitor);
+  g_settings_sync ();
+}
+
+void
+webapp_add_to_favorites (const char *favorite)
+{
+  const gchar *favorites[] = { favorite, NULL };
+
+  webapp_add_to_favorites_list (favorites);
+}
+
+void
+webapp_add_to_favorites_list (const gchar * const *favorites)
+{
+  GPtrArray *apps_array;
+  guint idx, n_favorite_apps;
+
+  if (the_monitor == NULL || favorites == NULL || favorites[0] == NULL)
+    return;
+
+  g_debug ("%s called, first fav: %s", G_STRFUNC, favorites[0]);
+
+  /* Add newly-installed apps to Shell's favorites */
+  n_favorite_apps = g_strv_length (the_monitor->favorite_apps);
+  apps_array = g_ptr_array_new ();
+  for (idx = 0; idx < n_favorite_apps; idx++)
+    g_ptr_array_add (apps_array, the_monitor->favorite_apps[idx]);
+
+  for (idx = 0; favorites[idx] != NULL; idx++) {
+    if (g_hash_table_contains (the_monitor->favorites, favorites[idx]))
+      continue;
+
+    /* Also skips duplicates within @favorites */
+    g_hash_table_add (the_monitor->favorites, (gpointer) favorites[idx]);
+    g_ptr_array_add (apps_array, (gpointer) favorites[idx]);
+  }
+  g_ptr_array_add (apps_array, NULL);
+
+  /* set_favorites refreshes the set, dropping the borrowed strings */
+  if (apps_array->len > n_favorite_apps + 1)
+    set_favorites (the_monitor, (const gchar * const *) apps_array->pdata);
+
+  g_ptr_array_free (apps_array, TRUE);
+}
+
+void
+webapp_remove_from_favorites (const char *favorite)
+{
+  const gchar *favorites[] = { favorite, NULL };
+
+  webapp_remove_from_favorites_list (favorites);
+}
+
+void
+webapp_remove_from_favorites_list (const gchar * const *favorites)
+{
+  GHashTable *removed;
+  GPtrArray *apps_array;
+  guint idx;
+
+  if (the_monitor == NULL || favorites == NULL)
+    return;
+
+  removed = g_hash_table_new (g_str_hash, g_str_equal);
+  for (idx = 0; favorites[idx] != NULL; idx++) {
+    g_debug ("%s called, fav: %s", G_STRFUNC, favorites[idx]);
+
+    if (g_hash_table_contains (the_monitor->favorites, favorites[idx]))
+      g_hash_table_add (removed, (gpointer) favorites[idx]);
+  }
+
+  /* Remove apps from Shell's favorites */
+  if (g_hash_table_size (removed) > 0) {
+    apps_array = g_ptr_array_new ();
+    for (idx = 0; the_monitor->favorite_apps[idx] != NULL; idx++) {
+      if (!g_hash_table_contains (removed, the_monitor->favorite_apps[idx]))
+	g_ptr_array_add (apps_array, the_monitor->favorite_apps[idx]);
+    }
+    g_ptr_array_add (apps_array, NULL);
+
+    set_favorites (the_monitor, (const gchar * const *) apps_array->pdata);
+
+    g_ptr_array_free (apps_array, TRUE);
+  }
+
+  g_hash_table_destroy (removed);
+}
+
+static gboolean
+is_favorite (WebappMonitor *monitor, WebappIndexEntry *entry)
+{
+  return g_hash_table_contains (monitor->favorites, g_basename (entry->path));
+}
+
+static void dispatch_icon_requests (WebappMonitor *monitor);
+
+static gboolean
+on_icon_request_timeout (gpointer user_data)
+{
+  WebappIconRequest *request = (WebappIconRequest *) user_data;
+  WebappMonitor *monitor = request->monitor;
+
+  g_debug ("%s no icon received for %s", G_STRFUNC, request->url);
+
+  request->timeout_id = 0;
+  request->state = ICON_REQUEST_DONE;
+  monitor->n_icon_requests_in_flight--;
+
+  dispatch_icon_requests (monitor);
+
+  return FALSE;
+}
+
+/* Sends queued requests to the icon loader callback, favorites first,
+ * keeping at most MAX_ICON_REQUESTS in flight. All URLs go in a single
+ * call, as arguments of the callback */
+static gboolean
+dispatch_icon_requests_cb (gpointer user_data)
+{
+  WebappMonitor *monitor = (WebappMonitor *) user_data;
+  WebappIconRequest *requests[MAX_ICON_REQUESTS];
+  NPVariant url_vargs[MAX_ICON_REQUESTS], result;
+  WebappMonitorClient *client;
+  guint n_requests = 0, idx;
+
+  monitor->dispatch_icons_id = 0;
+
+  client = get_icon_loader_client (monitor);
+  while (client != NULL &&
+	 monitor->n_icon_requests_in_flight + n_requests < MAX_ICON_REQUESTS) {
+    WebappIconRequest *request;
+
+    request = g_queue_pop_head (monitor->favorite_icon_queue);
+    if (request == NULL)
+      request = g_queue_pop_head (monitor->icon_queue);
+    if (request == NULL)
+      break;
+
+    STRINGZ_TO_NPVARIANT(request->url, url_vargs[n_requests]);
+    requests[n_requests++] = request;
+  }
+
+  if (n_requests > 0) {
+    NPObject *callback;
+    NPP instance;
+    gboolean invoked;
+
+    g_debug ("%s requesting %u icons", G_STRFUNC, n_requests);
+
+    /* The callback runs page script, which could destroy any instance
+     * and so free @client */
+    instance = client->instance;
+    callback = NPN_RetainObject (client->icon_loader_callback);
+
+    NULL_TO_NPVARIANT(result);
+    invoked = NPN_InvokeDefault (instance, callback, url_vargs, n_requests, &result);
+    if (!invoked)
+      g_debug ("Failed calling JS callback");
+    NPN_ReleaseVariantValue (&result);
+    NPN_ReleaseObject (callback);
+
+    if (find_client (monitor, instance) == NULL) {
+      /* Ask the next icon loader instead */
+      for (idx = n_requests; idx > 0; idx--) {
+	if (requests[idx - 1]->state == ICON_REQUEST_QUEUED)
+	  g_queue_push_head (monitor->icon_queue, requests[idx - 1]);
+      }
+      dispatch_icon_requests (monitor);
+      return FALSE;
+    }
+
+    for (idx = 0; idx < n_requests; idx++) {
+      WebappIconRequest *request = requests[idx];
+
+      /* Already completed from the callback */
+      if (request->state != ICON_REQUEST_QUEUED)
+	continue;
+
+      if (invoked) {
+	request->state = ICON_REQUEST_IN_FLIGHT;
+	request->instance = instance;
+	request->timeout_id = g_timeout_add_seconds (ICON_REQUEST_TIMEOUT, on_icon_request_timeout, request);
+	monitor->n_icon_requests_in_flight++;
+      } else {
+	request->state = ICON_REQUEST_DONE;
+      }
+    }
+  }
+
+  return FALSE;
+}
+
+/* Dispatching is deferred so that requests queued together, like those
+ * of a scan batch, are sent together */
+static void
+dispatch_icon_requests (WebappMonitor *monitor)
+{
+  if (monitor->dispatch_icons_id == 0)
+    monitor->dispatch_icons_id = g_idle_add (dispatch_icon_requests_cb, monitor);
+}
+
+/* Queues a request for a better icon for @entry, if it needs one and
+ * none was requested before. Requests wait for an icon loader callback
+ * to be set if there is none yet */
+static void
+retrieve_highres_icon (WebappMonitor *monitor, WebappIndexEntry *entry)
+{
+  WebappIconRequest *request;
+
+  if (entry->url == NULL)
+    return;
+
+  if (entry->icon_size >= 64)
+    return;
+
+  if (g_hash_table_contains (monitor->icon_requests, entry->url))
+    return;
+
+  g_debug ("Found URL %s", entry->url);
+
+  request = g_new0 (WebappIconRequest, 1);
+  request->monitor = monitor;
+  request->url = g_strdup (entry->url);
+  request->state = ICON_REQUEST_QUEUED;
+  g_hash_table_insert (monitor->icon_requests, request->url, request);
+
+  if (is_favorite (monitor, entry))
+    g_queue_push_tail (monitor->favorite_icon_queue, request);
+  else
+    g_queue_push_tail (monitor->icon_queue, request);
+
+  dispatch_icon_requests (monitor);
+}
+
+/* Called when an icon for @url was received, or the browser has none to
+ * give, to let further requests through */
+void
+webapp_monitor_complete_icon_request (const gchar *url)
+{
+  WebappIconRequest *request;
+
+  if (the_monitor == NULL || url == NULL)
+    return;
+
+  request = g_hash_table_lookup (the_monitor->icon_requests, url);
+  if (request == NULL)
+    return;
+
+  switch (request->state) {
+  case ICON_REQUEST_QUEUED:
+    g_queue_remove (the_monitor->favorite_icon_queue, request);
+    g_queue_remove (the_monitor->icon_queue, request);
+    break;
+  case ICON_REQUEST_IN_FLIGHT:
+    g_source_remove (request->timeout_id);
+    request->timeout_id = 0;
+    the_monitor->n_icon_requests_in_flight--;
+    break;
+  case ICON_REQUEST_DONE:
+    return;
+  }
+
+  request->state = ICON_REQUEST_DONE;
+
+  dispatch_icon_requests (the_monitor);
+}
+
+/* Records that icons of up to @size pixels were installed for the
+ * desktop file launching @url. The indexed size is otherwise only read
+ * from the desktop file, and the cached index would keep asking for an
+ * icon on every start */
+void
+webapp_monitor_set_icon_size_for_url (const gchar *url, gint size)
+{
+  WebappIndexEntry *entry;
+  gboolean changed = FALSE;
+
+  if (the_monitor == NULL || url == NULL)
+    return;
+
+  G_LOCK (index);
+  entry = g_hash_table_lookup (the_monitor->entries_by_url, url);
+  if (entry != NULL && entry->icon_size < size) {
+    entry->icon_size = size;
+    changed = TRUE;
+  }
+  G_UNLOCK (index);
+
+  if (changed)
+    schedule_save_index_cache (the_monitor);
+}
+
+static void
+on_desktop_directory_changed (GFileMonitor     *file_monitor,
+			      GFile            *file,
+			      GFile            *other_file,
+			      GFileMonitorEvent event_type,
+			      gpointer          user_data)
+{
+  const gchar *file_path = g_file_get_path (file);
+  GError *error = NULL;
+  gchar *contents, *new_path;
+  gsize len;
+
+  /* ~/Desktop has changed. We do the following:
+   * - Check if it's a new chrome-*.desktop file
+   * - Create a .desktop file for it in ~/.local/share/applications as
+   *   the user may have only selected 'Desktop' and not 'Menus'
+   * - Add it to favorite-apps
+   */
+
+  g_debug ("%s called", G_STRFUNC);
+
+  if (event_type != G_FILE_MONITOR_EVENT_CREATED)
+    return;
+
+  if (!g_str_has_prefix (g_path_get_basename (file_path), "chrome-"))
+    return;
+  if (!g_str_has_suffix (g_path_get_basename (file_path), ".desktop"))
+    return;
+
+  if (!g_file_get_contents (file_path, &contents, &len, &error)) {
+    g_warning ("Could not read %s file: %s", file_path, error->message);
+    g_clear_error (&error);
+    return;
+  }
+
+  rewrite_exec_line (&contents, &len);
+
+  new_path = g_build_filename (g_get_home_dir (), ".local/share/applications",
+			       g_path_get_basename (file_path), NULL);
+  if (!webapp_monitor_write_desktop_file (new_path, contents, len, &error)) {
+    g_warning ("Could not write %s file: %s", new_path, error->message);
+    g_error_free (error);
+    goto out;
+  }
+
+  if (!g_unlink (file_path))
+    g_debug ("Could not remove file %s\n", file_path);
+
+  webapp_add_to_favorites (g_path_get_basename (file_path));
 
-static WebappMonitor *the_monitor = NULL;
+out:
+  g_free (new_path);
+}
 
-static void
-webapp_monitor_finalize (GObject *object)
+/* Reads, fixes up and indexes the desktop file at @file_path */
+static WebappIndexEntry *
+process_desktop_file (WebappMonitor *monitor, const gchar *file_path)
 {
-  WebappMonitor *monitor = (WebappMonitor *) object;
+  WebappIndexEntry *entry;
 
-  g_clear_object (&monitor->file_monitor);
-  g_clear_object (&monitor->desktop_file_monitor);
+  entry = parse_desktop_file (file_path);
+  if (entry == NULL)
+    return NULL;
 
-  if (monitor->icon_loader_callback != NULL) {
-    NPN_ReleaseObject (monitor->icon_loader_callback);
-    monitor->icon_loader_callback = NULL;
-  }
+  insert_index_entry (monitor, entry);
+  schedule_save_index_cache (monitor);
 
-  G_OBJECT_CLASS (webapp_monitor_parent_class)->finalize (object);
+  return entry;
 }
 
-static void
-webapp_monitor_class_init (WebappMonitorClass *klass)
+static gboolean
+is_chrome_desktop_file (const gchar *path)
 {
-  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  const gchar *name = g_basename (path);
 
-  object_class->finalize = webapp_monitor_finalize;
+  return g_str_has_prefix (name, "chrome-") && g_str_has_suffix (name, ".desktop");
 }
 
-static gint
-get_icon_size (GKeyFile *key_file)
+static void
+webapp_pending_event_free (WebappPendingEvent *pending)
 {
-  gchar *icon;
-  gint icon_size = 0;
+  if (pending->timeout_id != 0)
+    g_source_remove (pending->timeout_id);
 
-  icon = g_key_file_get_string (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_ICON, NULL);
-  if (!icon)
-    return 0;
+  g_free (pending->path);
+  g_free (pending);
+}
 
-  if (g_path_is_absolute (icon)) {
-    GdkPixbuf *pixbuf;
-    gint width, height;
-    GError *error = NULL;
+/* Processes a desktop file once, for all the events received for it */
+static void
+flush_pending_event (WebappMonitor *monitor, const gchar *path, gboolean created)
+{
+  WebappPendingEvent *pending;
+  WebappIndexEntry *entry;
 
-    pixbuf = gdk_pixbuf_new_from_file (icon, &error);
-    width = gdk_pixbuf_get_width (pixbuf);
-    height = gdk_pixbuf_get_height (pixbuf);
+  pending = g_hash_table_lookup (monitor->pending_events, path);
+  if (pending != NULL)
+    created = created || pending->created;
+  created = created || g_hash_table_contains (monitor->created_files, path);
 
-    g_object_unref (pixbuf);
+  if (is_self_write (path, &entry)) {
+    /* Our own write, whose contents we already know */
+    monitor->n_events_suppressed += pending != NULL ? pending->n_events : 1;
 
-    icon_size = MIN (width, height);
+    if (entry != NULL) {
+      insert_index_entry (monitor, entry);
+      schedule_save_index_cache (monitor);
+    }
   } else {
-    gint *sizes, i;
-    GtkIconTheme *icon_theme = gtk_icon_theme_get_default ();
-
-    sizes = gtk_icon_theme_get_icon_sizes (icon_theme, icon);
-    if (sizes != NULL) {
-      for (i = 0; sizes != NULL && sizes[i] != 0; i++) {
-        g_debug ("size %d found for icon %s", sizes[i], icon);
-        if (sizes[i] == -1) { /* Scalable */
-          icon_size = 256;
-          break;
-        }
-
-        icon_size = MAX (icon_size, sizes[i]);
-      }
+    if (pending != NULL)
+      monitor->n_events_merged += pending->n_events - 1;
+
+    entry = process_desktop_file (monitor, path);
+    monitor->n_files_processed++;
 
-      g_free (sizes);
+    /* A slow writer may not have written the Exec line yet when the
+     * quiet period ends */
+    if (created && (entry == NULL || entry->url == NULL)) {
+      g_hash_table_add (monitor->created_files, g_strdup (path));
+      created = FALSE;
     }
   }
 
-  g_free (icon);
+  if (created)
+    g_hash_table_remove (monitor->created_files, path);
 
-  return icon_size;
+  g_debug ("%s %s: %u events, %u merged, %u suppressed, %u files processed", G_STRFUNC,
+	   path, monitor->n_events, monitor->n_events_merged,
+	   monitor->n_events_suppressed, monitor->n_files_processed);
+
+  /* Only ask for a better icon for new desktop files */
+  if (entry != NULL && created)
+    retrieve_highres_icon (monitor, entry);
+
+  /* May free @path */
+  if (pending != NULL)
+    g_hash_table_remove (monitor->pending_events, pending->path);
 }
 
-static void
-retrieve_highres_icon (WebappMonitor *monitor, const gchar *desktop_file)
+static gboolean
+on_event_quiet_period (gpointer user_data)
 {
-  GKeyFile *key_file;
-  gchar *s;
-  GError *error = NULL;
+  WebappPendingEvent *pending = (WebappPendingEvent *) user_data;
 
-  /* Get URL to get icon for */
-  key_file = g_key_file_new ();
-  if (!g_key_file_load_from_data (key_file, desktop_file, strlen (desktop_file), 0, &error)) {
-    g_warning ("Could not parse desktop file: %s", error->message);
-    g_error_free (error);
+  pending->timeout_id = 0;
+  flush_pending_event (pending->monitor, pending->path, FALSE);
 
-    goto out;
+  return FALSE;
+}
+
+static void
+queue_pending_event (WebappMonitor *monitor, const gchar *path, gboolean created)
+{
+  WebappPendingEvent *pending;
+
+  pending = g_hash_table_lookup (monitor->pending_events, path);
+  if (pending == NULL) {
+    pending = g_new0 (WebappPendingEvent, 1);
+    pending->monitor = monitor;
+    pending->path = g_strdup (path);
+    g_hash_table_insert (monitor->pending_events, pending->path, pending);
+  } else {
+    g_source_remove (pending->timeout_id);
   }
 
-  if (get_icon_size (key_file) >= 64)
-    goto out;
+  pending->created = pending->created || created;
+  pending->n_events++;
+  pending->timeout_id = g_timeout_add (EVENT_QUIET_PERIOD, on_event_quiet_period, pending);
+}
 
-  s =  g_key_file_get_string (key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_EXEC, NULL);
-  if (s != NULL) {
-    gint n_args, i;
-    gchar **args, *url = NULL;
+static void
+remove_desktop_file (WebappMonitor *monitor, const gchar *path)
+{
+  WebappPendingEvent *pending;
 
-    g_debug ("Parsing command line %s", s);
+  pending = g_hash_table_lookup (monitor->pending_events, path);
+  if (pending != NULL) {
+    monitor->n_events_merged += pending->n_events;
+    g_hash_table_remove (monitor->pending_events, path);
+  }
+  g_hash_table_remove (monitor->created_files, path);
 
-    if (!g_shell_parse_argv (s, &n_args, &args, &error)) {
-      g_debug ("Failed parsing command line %s", s);
-      goto out;
-    }
+  forget_self_write (path);
 
-    for (i = 0; i < n_args && args[i] != NULL; i++) {
-      g_debug ("Processing argument %s", args[i]);
-      if (g_str_has_prefix (args[i], "--app=")) {
-	url = g_strdup (args[i] + 6);
-	g_debug ("Found URL %s", url);
-	break;
-      }
-    }
+  if (monitor->scan != NULL)
+    g_hash_table_add (monitor->scan->deleted, g_strdup (path));
 
-    if (url != NULL) {
-      NPVariant url_varg, result;
+  G_LOCK (index);
+  unindex_desktop_file (monitor, path);
+  G_UNLOCK (index);
 
-      STRINGZ_TO_NPVARIANT(url, url_varg);
-      NULL_TO_NPVARIANT(result);
+  schedule_save_index_cache (monitor);
+}
 
-      if (!NPN_InvokeDefault (monitor->instance, monitor->icon_loader_callback, &url_varg, 1, &result))
-      	g_debug ("Failed calling JS callback");
+static void
+on_directory_changed (GFileMonitor     *file_monitor,
+		      GFile            *file,
+		      GFile            *other_file,
+		      GFileMonitorEvent event_type,
+		      gpointer          user_data)
+{
+  WebappMonitor *monitor = (WebappMonitor *) user_data;
+  gchar *file_path, *other_path = NULL;
 
-      g_free (url);
-      NPN_ReleaseVariantValue (&result);
-    }
+  g_debug ("%s called", G_STRFUNC);
 
-    g_strfreev (args);
-    g_free (s);
+  monitor->n_events++;
+
+  file_path = g_file_get_path (file);
+  if (other_file != NULL)
+    other_path = g_file_get_path (other_file);
+
+  switch (event_type) {
+  case G_FILE_MONITOR_EVENT_CREATED:
+  case G_FILE_MONITOR_EVENT_CHANGED:
+    if (is_chrome_desktop_file (file_path))
+      queue_pending_event (monitor, file_path, event_type == G_FILE_MONITOR_EVENT_CREATED);
+    break;
+  case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+    /* Nothing to do if the quiet period already flushed the file */
+    if (is_chrome_desktop_file (file_path) &&
+	g_hash_table_contains (monitor->pending_events, file_path))
+      flush_pending_event (monitor, file_path, FALSE);
+    break;
+  case G_FILE_MONITOR_EVENT_DELETED:
+#if GLIB_CHECK_VERSION (2, 46, 0)
+  case G_FILE_MONITOR_EVENT_MOVED_OUT:
+#endif
+    if (is_chrome_desktop_file (file_path))
+      remove_desktop_file (monitor, file_path);
+    break;
+#if GLIB_CHECK_VERSION (2, 46, 0)
+  case G_FILE_MONITOR_EVENT_MOVED_IN:
+    /* A file moved in place is complete */
+    if (is_chrome_desktop_file (file_path))
+      flush_pending_event (monitor, file_path, TRUE);
+    break;
+  case G_FILE_MONITOR_EVENT_RENAMED:
+#endif
+  case G_FILE_MONITOR_EVENT_MOVED:
+    /* This is how g_file_set_contents() and most other writers replace
+     * files, and the target is complete once it's renamed */
+    if (is_chrome_desktop_file (file_path))
+      remove_desktop_file (monitor, file_path);
+    if (other_path != NULL && is_chrome_desktop_file (other_path))
+      flush_pending_event (monitor, other_path,
+			   g_hash_table_lookup (monitor->entries, other_path) == NULL);
+    break;
+  default:
+    break;
   }
 
- out:
-  g_key_file_free (key_file);
+  g_free (other_path);
+  g_free (file_path);
 }
 
-void
-webapp_add_to_favorites (const char *favorite)
+typedef struct {
+  ScanData *scan;
+  GPtrArray *entries;
+} ScanBatch;
+
+/* Runs @func in the main context. The source is recorded, so that it can
+ * be removed if the scan is stopped before it runs */
+static void
+scan_invoke (ScanData *scan, GSourceFunc func, gpointer data, GDestroyNotify notify)
 {
-  GSettings *settings;
-  gchar **favorite_apps;
-  GPtrArray *apps_array;
+  guint id;
+
+  g_mutex_lock (&scan->lock);
+  id = g_idle_add_full (G_PRIORITY_DEFAULT, func, data, notify);
+  scan->sources = g_slist_prepend (scan->sources, GUINT_TO_POINTER (id));
+  g_mutex_unlock (&scan->lock);
+}
+
+/* Called by the sources added through scan_invoke when they run */
+static void
+forget_scan_source (ScanData *scan)
+{
+  guint id = g_source_get_id (g_main_current_source ());
+
+  g_mutex_lock (&scan->lock);
+  scan->sources = g_slist_remove (scan->sources, GUINT_TO_POINTER (id));
+  g_mutex_unlock (&scan->lock);
+}
 
-  g_debug ("%s called, fav: %s", G_STRFUNC, favorite);
+static void
+scan_batch_free (ScanBatch *batch)
+{
+  /* Entries not consumed by deliver_scan_batch */
+  g_ptr_array_foreach (batch->entries, (GFunc) webapp_index_entry_free, NULL);
+  g_ptr_array_free (batch->entries, TRUE);
 
-  /* Add newly-installed app to Shell's favorites */
-  settings = g_settings_new ("org.gnome.shell");
+  g_free (batch);
+}
 
-  apps_array = g_ptr_array_new ();
-  favorite_apps = g_settings_get_strv (settings, "favorite-apps");
-  if (favorite_apps != NULL) {
-    guint idx;
+/* Runs in the main context */
+static gboolean
+deliver_scan_batch (gpointer user_data)
+{
+  ScanBatch *batch = (ScanBatch *) user_data;
+  WebappMonitor *monitor = batch->scan->monitor;
+  guint idx;
+
+  forget_scan_source (batch->scan);
+
+  if (g_cancellable_is_cancelled (batch->scan->cancellable))
+    return FALSE;
 
-    for (idx = 0; favorite_apps[idx] != NULL; idx++) {
-      g_ptr_array_add (apps_array, favorite_apps[idx]);
+  for (idx = 0; idx < batch->entries->len; idx++) {
+    WebappIndexEntry *entry = g_ptr_array_index (batch->entries, idx);
+
+    /* Anything indexed or removed from file monitor events since the
+     * scan started is at least as recent as what the scan found */
+    if (g_hash_table_lookup (monitor->entries, entry->path) != NULL ||
+	g_hash_table_contains (batch->scan->deleted, entry->path)) {
+      webapp_index_entry_free (entry);
+      continue;
     }
-  }
 
-  g_ptr_array_add (apps_array, (gpointer) favorite);
-  g_ptr_array_add (apps_array, NULL);
+    insert_index_entry (monitor, entry);
+    retrieve_highres_icon (monitor, entry);
+  }
 
-  g_settings_set_strv (settings, "favorite-apps", (const gchar *const *) apps_array->pdata);
+  g_ptr_array_set_size (batch->entries, 0);
 
-  g_strfreev (favorite_apps);
-  g_ptr_array_free (apps_array, TRUE);
-  g_object_unref (settings);
+  return FALSE;
 }
 
-/* Workaround for https://code.google.com/p/chromium/issues/detail?id=247574
- * TODO: drop this hack when we no longer support Chrome << 29
- */
-static gboolean
-fix_exec_line (gchar **contents)
+static void
+flush_scan_batch (ScanData *scan)
 {
-  if (strstr (*contents, "Exec=/opt/google/chrome/chrome"))
-    {
-      GString *string;
-      gssize pos;
+  ScanBatch *batch;
+
+  g_mutex_lock (&scan->lock);
 
-      g_debug ("New desktop file has wrong Exec line, amending it");
+  if (scan->batch->len == 0) {
+    g_mutex_unlock (&scan->lock);
+    return;
+  }
 
-      pos = strstr (*contents, "Exec=/opt/google/chrome/chrome") - *contents;
-      pos += strlen ("Exec=/opt/google/chrome/");
+  batch = g_new0 (ScanBatch, 1);
+  batch->scan = scan;
+  batch->entries = scan->batch;
+  scan->batch = g_ptr_array_new ();
 
-      string = g_string_new (*contents);
+  g_mutex_unlock (&scan->lock);
 
-      g_string_insert (string, pos, "google-");
+  scan_invoke (scan, deliver_scan_batch, batch, (GDestroyNotify) scan_batch_free);
+}
 
-      g_free (*contents);
-      *contents = g_string_free (string, FALSE);
+static void
+add_to_scan_batch (ScanData *scan, WebappIndexEntry *entry)
+{
+  gboolean full;
 
-      return TRUE;
-    }
+  g_mutex_lock (&scan->lock);
+  g_ptr_array_add (scan->batch, entry);
+  full = scan->batch->len >= SCAN_BATCH_SIZE;
+  g_mutex_unlock (&scan->lock);
 
-  return FALSE;
+  if (full)
+    flush_scan_batch (scan);
 }
 
 static void
-on_desktop_directory_changed (GFileMonitor     *file_monitor,
-			      GFile            *file,
-			      GFile            *other_file,
-			      GFileMonitorEvent event_type,
-			      gpointer          user_data)
+parse_desktop_file_func (gpointer data, gpointer user_data)
 {
-  const gchar *file_path = g_file_get_path (file);
-  GError *error = NULL;
-  gchar *contents, *new_path;
+  ScanData *scan = (ScanData *) user_data;
+  gchar *path = (gchar *) data;
+  WebappIndexEntry *entry;
+
+  if (!g_cancellable_is_cancelled (scan->cancellable)) {
+    entry = parse_desktop_file (path);
+    if (entry != NULL)
+      add_to_scan_batch (scan, entry);
+  }
 
-  /* ~/Desktop has changed. We do the following:
-   * - Check if it's a new chrome-*.desktop file
-   * - Create a .desktop file for it in ~/.local/share/applications as
-   *   the user may have only selected 'Desktop' and not 'Menus'
-   * - Add it to favorite-apps
-   */
+  g_free (path);
+}
 
-  g_debug ("%s called", G_STRFUNC);
+/* The callback is detached from @client before running it, as it runs
+ * page script that could destroy any instance, including @client's */
+static void
+notify_client_ready (WebappMonitorClient *client)
+{
+  NPObject *callback = client->ready_callback;
+  NPP instance = client->instance;
+  NPVariant result;
 
-  if (event_type != G_FILE_MONITOR_EVENT_CREATED)
+  if (callback == NULL)
     return;
 
-  if (!g_str_has_prefix (g_path_get_basename (file_path), "chrome-"))
-    return;
-  if (!g_str_has_suffix (g_path_get_basename (file_path), ".desktop"))
-    return;
+  client->ready_callback = NULL;
 
-  if (!g_file_get_contents (file_path, &contents, NULL, &error)) {
-    g_warning ("Could not read %s file: %s", file_path, error->message);
-    g_clear_error (&error);
-    return;
-  }
+  NULL_TO_NPVARIANT (result);
 
-  fix_exec_line (&contents);
+  if (!NPN_InvokeDefault (instance, callback, NULL, 0, &result))
+    g_debug ("Failed calling JS callback");
 
-  new_path = g_build_filename (g_get_home_dir (), ".local/share/applications",
-			       g_path_get_basename (file_path), NULL);
-  if (!g_file_set_contents (new_path, contents, -1, &error)) {
-    g_warning ("Could not write %s file: %s", new_path, error->message);
-    g_error_free (error);
-    goto out;
+  NPN_ReleaseVariantValue (&result);
+  NPN_ReleaseObject (callback);
+}
+
+static void
+notify_ready (WebappMonitor *monitor)
+{
+  GPtrArray *instances;
+  GList *l;
+  guint i;
+
+  /* The callbacks could destroy any instance, so clients are looked up
+   * again by instance before each call */
+  instances = g_ptr_array_new ();
+  for (l = monitor->clients; l != NULL; l = l->next)
+    g_ptr_array_add (instances, ((WebappMonitorClient *) l->data)->instance);
+
+  for (i = 0; i < instances->len; i++) {
+    WebappMonitorClient *client;
+
+    client = find_client (monitor, g_ptr_array_index (instances, i));
+    if (client != NULL)
+      notify_client_ready (client);
   }
 
-  if (!g_unlink (file_path))
-    g_debug ("Could not remove file %s\n", file_path);
+  g_ptr_array_free (instances, TRUE);
+}
 
-  webapp_add_to_favorites (g_path_get_basename (file_path));
+static void
+scan_data_free (ScanData *scan)
+{
+  g_ptr_array_foreach (scan->batch, (GFunc) webapp_index_entry_free, NULL);
+  g_ptr_array_free (scan->batch, TRUE);
+  g_mutex_clear (&scan->lock);
+
+  g_hash_table_destroy (scan->deleted);
+  g_free (scan->applications_dir);
+  g_object_unref (scan->cancellable);
+  g_free (scan);
+}
 
-out:
-  g_free (new_path);
+/* Waits for the scan thread and removes the sources it added that did
+ * not run yet, so that nothing is left running once the plugin is
+ * unloaded */
+static void
+free_scan (WebappMonitor *monitor)
+{
+  ScanData *scan = monitor->scan;
+  GSList *l;
+
+  if (scan == NULL)
+    return;
+
+  monitor->scan = NULL;
+
+  g_thread_join (scan->thread);
+
+  for (l = scan->sources; l != NULL; l = l->next)
+    g_source_remove (GPOINTER_TO_UINT (l->data));
+  g_slist_free (scan->sources);
+
+  scan_data_free (scan);
 }
 
 static void
-on_directory_changed (GFileMonitor     *file_monitor,
-		      GFile            *file,
-		      GFile            *other_file,
-		      GFileMonitorEvent event_type,
-		      gpointer          user_data)
+stop_scan (WebappMonitor *monitor)
 {
-  WebappMonitor *monitor = (WebappMonitor *) user_data;
+  if (monitor->scan != NULL) {
+    g_cancellable_cancel (monitor->scan->cancellable);
+    free_scan (monitor);
+  }
+}
 
-  g_debug ("%s called", G_STRFUNC);
+/* Runs in the main context, after all batches have been delivered */
+static gboolean
+finish_scan (gpointer user_data)
+{
+  ScanData *scan = (ScanData *) user_data;
+  WebappMonitor *monitor = scan->monitor;
 
-  if (event_type == G_FILE_MONITOR_EVENT_CREATED) {
-     GError *error = NULL;
-     gchar *contents;
-     gsize len;
-     const gchar *file_path = g_file_get_path (file);
+  forget_scan_source (scan);
 
-     if (!g_str_has_prefix (g_basename (file_path), "chrome-"))
-       return;
+  if (g_cancellable_is_cancelled (scan->cancellable))
+    return FALSE;
 
-     if (g_file_get_contents (file_path, &contents, &len, &error)) {
-       g_debug ("Old contents = %s\n", contents);
+  g_debug ("%s indexed %u desktop files", G_STRFUNC, g_hash_table_size (monitor->entries));
 
-       if (fix_exec_line (&contents)) {
-	   if (!g_file_set_contents (file_path, contents, -1, &error)) {
-	     g_warning ("Could not write %s file: %s", file_path, error->message);
-	     g_error_free (error);
-	   } else {
-	     g_debug ("New contents: %s\n", contents);
-	   }
-       }
+  monitor->dir_mtime = scan->dir_mtime;
+  monitor->ready = TRUE;
 
-       retrieve_highres_icon (monitor, contents);
+  /* Queued last by the thread, so joining it does not block */
+  free_scan (monitor);
 
-       g_free (contents);
+  if (can_save_index_cache (monitor))
+    save_index_cache (monitor);
+  else
+    schedule_save_index_cache (monitor);
 
-     } else {
-       g_warning ("Could not read %s file: %s", file_path, error->message);
-       g_error_free (error);
-     }
-  }
+  notify_ready (monitor);
+
+  return FALSE;
 }
 
-static void
-webapp_monitor_init (WebappMonitor *monitor)
+/* Indexes the chrome-* desktop files that already exist on startup.
+ * Files whose inode, size and mtime match the saved index are not read,
+ * and if the directory itself didn't change, it's not even listed. The
+ * other files are parsed in parallel, and the results are sent to the
+ * main context in batches */
+static gpointer
+scan_applications_directory (gpointer user_data)
 {
-  gchar *path = g_strdup_printf ("%s/.local/share/applications", g_get_home_dir ());
-  GFile *file = g_file_new_for_path (path);
+  ScanData *scan = (ScanData *) user_data;
+  GHashTable *cache;
+  GHashTableIter iter;
+  WebappIndexEntry *entry;
+  GThreadPool *pool;
+  guint64 inode, size;
+  gint64 dir_mtime, cached_dir_mtime = -1;
+  GDir *dir;
+  const gchar *name;
   GError *error = NULL;
 
-  monitor->instance = NULL;
-  monitor->icon_loader_callback = NULL;
+  cache = load_index_cache (scan->applications_dir, &cached_dir_mtime);
 
-  monitor->file_monitor = g_file_monitor_directory (file, 0, NULL, &error);
-  if (monitor->file_monitor) {
-    GDir *dir;
+  /* Taken before listing, so that files added meanwhile change it */
+  if (!stat_file (scan->applications_dir, &inode, &size, &dir_mtime))
+    dir_mtime = -1;
+  scan->dir_mtime = dir_mtime;
 
-    /* Check already existing files on startup */
-    dir = g_dir_open (path, 0, &error);
-    if (dir) {
-      const gchar *name;
+  if (cache != NULL && dir_mtime != -1 && dir_mtime == cached_dir_mtime) {
+    g_debug ("%s directory unchanged, using cached index", G_STRFUNC);
 
-      while (name = g_dir_read_name (dir)) {
-	if (g_str_has_prefix (name, "chrome-")) {
-	  gchar *full_path = g_strdup_printf ("%s/%s", path, name);
-	  GFile *file_to_check = g_file_new_for_path (full_path);
+    g_hash_table_iter_init (&iter, cache);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &entry)) {
+      g_hash_table_iter_steal (&iter);
+      add_to_scan_batch (scan, entry);
+    }
 
-	  on_directory_changed (monitor->file_monitor, file_to_check, NULL, G_FILE_MONITOR_EVENT_CREATED, monitor);
+    goto out;
+  }
 
-	  g_free (full_path);
-	  g_object_unref (file_to_check);
-	}
-      }
+  dir = g_dir_open (scan->applications_dir, 0, &error);
+  if (dir == NULL) {
+    g_warning ("Error opening directory %s: %s\n", scan->applications_dir, error->message);
+    g_error_free (error);
+    goto out;
+  }
 
-      g_dir_close (dir);
+  pool = g_thread_pool_new (parse_desktop_file_func, scan,
+			    g_get_num_processors (), FALSE, NULL);
+
+  while ((name = g_dir_read_name (dir)) && !g_cancellable_is_cancelled (scan->cancellable)) {
+    gchar *full_path;
+    gint64 mtime;
+
+    if (!is_chrome_desktop_file (name))
+      continue;
+
+    full_path = g_build_filename (scan->applications_dir, name, NULL);
+
+    entry = cache != NULL ? g_hash_table_lookup (cache, name) : NULL;
+    if (entry != NULL &&
+	stat_file (full_path, &inode, &size, &mtime) &&
+	entry->inode == inode && entry->size == size && entry->mtime == mtime) {
+      g_hash_table_steal (cache, name);
+      add_to_scan_batch (scan, entry);
+      g_free (full_path);
     } else {
-      g_error ("Error opening directory %s: %s\n", path, error->message);
-      g_error_free (error);
+      g_thread_pool_push (pool, full_path, NULL);
     }
+  }
+
+  g_thread_pool_free (pool, FALSE, TRUE);
+  g_dir_close (dir);
+
+ out:
+  if (cache != NULL)
+    g_hash_table_destroy (cache);
+
+  flush_scan_batch (scan);
+  scan_invoke (scan, finish_scan, scan, NULL);
+
+  return NULL;
+}
+
+static void
+start_scan (WebappMonitor *monitor)
+{
+  ScanData *scan;
+
+  scan = g_new0 (ScanData, 1);
+  scan->monitor = monitor;
+  scan->cancellable = g_object_ref (monitor->scan_cancellable);
+  scan->applications_dir = g_strdup (monitor->applications_dir);
+  scan->deleted = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  scan->batch = g_ptr_array_new ();
+  g_mutex_init (&scan->lock);
+
+  monitor->scan = scan;
+  scan->thread = g_thread_new ("webapp-scan", scan_applications_directory, scan);
+}
+
+static void
+webapp_monitor_init (WebappMonitor *monitor)
+{
+  gchar *path = g_strdup_printf ("%s/.local/share/applications", g_get_home_dir ());
+  GFile *file = g_file_new_for_path (path);
+  GError *error = NULL;
+
+  monitor->clients = NULL;
+
+  monitor->entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+					    (GDestroyNotify) webapp_index_entry_free);
+  monitor->entries_by_url = g_hash_table_new (g_str_hash, g_str_equal);
+  monitor->entries_by_app_id = g_hash_table_new (g_str_hash, g_str_equal);
+
+  monitor->applications_dir = g_strdup (path);
+  monitor->dir_mtime = -1;
+  monitor->scan_cancellable = g_cancellable_new ();
+
+  monitor->pending_events = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+						   (GDestroyNotify) webapp_pending_event_free);
+  monitor->created_files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  monitor->icon_requests = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+						  (GDestroyNotify) webapp_icon_request_free);
+  monitor->favorite_icon_queue = g_queue_new ();
+  monitor->icon_queue = g_queue_new ();
+
+  monitor->favorites_settings = g_settings_new ("org.gnome.shell");
+  g_settings_delay (monitor->favorites_settings);
+  monitor->favorites = g_hash_table_new (g_str_hash, g_str_equal);
+  refresh_favorites (monitor);
+  g_signal_connect (monitor->favorites_settings, "changed::favorite-apps",
+		    G_CALLBACK (on_favorites_changed), monitor);
+
+#if GLIB_CHECK_VERSION (2, 46, 0)
+  monitor->file_monitor = g_file_monitor_directory (file, G_FILE_MONITOR_WATCH_MOVES, NULL, &error);
+#else
+  monitor->file_monitor = g_file_monitor_directory (file, G_FILE_MONITOR_SEND_MOVED, NULL, &error);
+#endif
+  if (monitor->file_monitor) {
+    /* Check already existing files on startup, without blocking */
+    start_scan (monitor);
 
     /* Listen to changes in the ~/.local/share/applications directory */
     g_signal_connect (monitor->file_monitor, "changed", G_CALLBACK (on_directory_changed), monitor);
@@ -401,39 +1914,158 @@ webapp_monitor_init (WebappMonitor *monitor)
   g_object_unref (file);
 }
 
+/* Registers @instance with the monitor, creating it the first time */
 void
 webapp_initialize_monitor (NPP instance)
 {
+  WebappMonitorClient *client;
+
   g_debug ("%s called", G_STRFUNC);
 
-  if (the_monitor != NULL) {
+  if (the_monitor == NULL) {
+    WebappMonitor *monitor;
+
+    monitor = g_object_new (webapp_monitor_get_type (), NULL);
+
+    G_LOCK (index);
+    the_monitor = monitor;
+    G_UNLOCK (index);
+  } else {
     g_debug ("%s monitor already initialized", G_STRFUNC);
+  }
+
+  if (find_client (the_monitor, instance) != NULL)
+    return;
+
+  client = g_new0 (WebappMonitorClient, 1);
+  client->instance = instance;
+  the_monitor->clients = g_list_prepend (the_monitor->clients, client);
+}
+
+void
+webapp_monitor_set_icon_loader_callback (NPP instance, NPObject *callback)
+{
+  WebappMonitorClient *client;
+
+  g_debug ("%s called", G_STRFUNC);
+
+  if (!the_monitor || (client = find_client (the_monitor, instance)) == NULL) {
+    g_debug ("%s monitor not initialized", G_STRFUNC);
     return;
   }
 
-  the_monitor = g_object_new (webapp_monitor_get_type (), NULL);
-  the_monitor->instance = instance;
+  if (client->icon_loader_callback != NULL)
+    NPN_ReleaseObject (client->icon_loader_callback);
+  client->icon_loader_callback = NPN_RetainObject (callback);
+
+  /* Send the requests that were waiting for a callback */
+  dispatch_icon_requests (the_monitor);
 }
 
 void
-webapp_monitor_set_icon_loader_callback (NPObject *callback)
+webapp_monitor_set_ready_callback (NPP instance, NPObject *callback)
 {
+  WebappMonitorClient *client;
+
   g_debug ("%s called", G_STRFUNC);
 
-  if (!the_monitor) {
+  if (!the_monitor || (client = find_client (the_monitor, instance)) == NULL) {
     g_debug ("%s monitor not initialized", G_STRFUNC);
     return;
   }
 
-  the_monitor->icon_loader_callback = NPN_RetainObject (callback);
+  if (client->ready_callback != NULL)
+    NPN_ReleaseObject (client->ready_callback);
+  client->ready_callback = NPN_RetainObject (callback);
+
+  if (the_monitor->ready)
+    notify_client_ready (client);
+}
+
+/* Unregisters @instance. The monitor itself is kept, with its index and
+ * file monitors, until the plugin is unloaded */
+void
+webapp_destroy_monitor (NPP instance)
+{
+  WebappMonitorClient *client;
+  GHashTableIter iter;
+  WebappIconRequest *request;
+
+  g_debug ("%s called", G_STRFUNC);
+
+  if (the_monitor == NULL || (client = find_client (the_monitor, instance)) == NULL)
+    return;
+
+  the_monitor->clients = g_list_remove (the_monitor->clients, client);
+  webapp_monitor_client_free (client);
+
+  /* Icons the instance was capturing are asked for again, from another
+   * instance or the next one */
+  g_hash_table_iter_init (&iter, the_monitor->icon_requests);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &request)) {
+    if (request->state != ICON_REQUEST_IN_FLIGHT || request->instance != instance)
+      continue;
+
+    g_source_remove (request->timeout_id);
+    request->timeout_id = 0;
+    request->instance = NULL;
+    request->state = ICON_REQUEST_QUEUED;
+    the_monitor->n_icon_requests_in_flight--;
+    g_queue_push_head (the_monitor->icon_queue, request);
+  }
+
+  dispatch_icon_requests (the_monitor);
 }
 
 void
-webapp_destroy_monitor (void)
+webapp_shutdown_monitor (void)
 {
   g_debug ("%s called", G_STRFUNC);
 
   if (the_monitor != NULL) {
-    g_clear_object (&the_monitor);
+    WebappMonitor *monitor;
+
+    G_LOCK (index);
+    monitor = the_monitor;
+    the_monitor = NULL;
+    G_UNLOCK (index);
+
+    /* Also stops a running scan */
+    g_object_unref (monitor);
+  }
+}
+
+static gchar *
+lookup_icon (gboolean by_url, const gchar *key)
+{
+  WebappIndexEntry *entry;
+  gchar *icon = NULL;
+
+  G_LOCK (index);
+
+  if (the_monitor != NULL) {
+    entry = g_hash_table_lookup (by_url ? the_monitor->entries_by_url : the_monitor->entries_by_app_id, key);
+    if (entry != NULL)
+      icon = g_strdup (entry->icon);
   }
+
+  G_UNLOCK (index);
+
+  return icon;
+}
+
+/* Returns the Icon of the desktop file launching @url, or NULL. Can be
+ * called from any thread */
+gchar *
+webapp_monitor_lookup_icon_for_url (const gchar *url)
+{
+  return lookup_icon (TRUE, url);
+}
+
+/* Returns the Icon of the desktop file launching the Chrome app with ID
+ * @app_id, or NULL. Can be called from any thread */
+gchar *
+webapp_monitor_lookup_icon_for_app_id (const gchar *app_id)
+{
+  return lookup_icon (FALSE, app_id);
 }
@@ -24,14 +24,27 @@
 
 #ifndef WEBAPP_MONITOR_H
 
+#include <glib.h>
 #include "npapi-headers/headers/npapi.h"
 #include "npapi-headers/headers/npruntime.h"
 
 void      webapp_initialize_monitor (NPP instance);
-void      webapp_monitor_set_icon_loader_callback (NPObject *callback);
-void      webapp_destroy_monitor (void);
+void      webapp_monitor_set_icon_loader_callback (NPP instance, NPObject *callback);
+void      webapp_monitor_set_ready_callback (NPP instance, NPObject *callback);
+void      webapp_monitor_complete_icon_request (const gchar *url);
+void      webapp_monitor_set_icon_size_for_url (const gchar *url, gint size);
+void      webapp_destroy_monitor (NPP instance);
+void      webapp_shutdown_monitor (void);
+gchar    *webapp_monitor_lookup_icon_for_url (const gchar *url);
+gchar    *webapp_monitor_lookup_icon_for_app_id (const gchar *app_id);
+gboolean  webapp_monitor_write_desktop_file (const gchar *path, const gchar *contents,
+					     gssize len, GError **error);
 
 /* util */
 void      webapp_add_to_favorites (const char *favorite);
+void      webapp_add_to_favorites_list (const gchar * const *favorites);
+void      webapp_remove_from_favorites (const char *favorite);
+void      webapp_remove_from_favorites_list (const gchar * const *favorites);
+void      webapp_flush_favorites (void);
 
 #endif